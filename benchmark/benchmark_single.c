@@ -178,6 +178,7 @@ int main(int argc, char *argv[])
         npheap_unlock(devfd, i);
 
     }
+    npheap_release(devfd);
     close(devfd);
 #ifdef DEBUG
     printf("The benchmark program is going to exit.");
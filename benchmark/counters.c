@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <npheap.h>
+#include <npheap/npheap.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/wait.h>
+
+// Measures the cost of the module's operation counters: every process
+// hammers lock/getsize/unlock and touches its own object's pages, then
+// the parent reports the aggregate throughput. Run it with the module's
+// stats parameter on and off and compare (see test_counters.sh). With a
+// third argument of "checksum" each unlock also checksums the object.
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int main(int argc, char *argv[])
+{
+    int i, number_of_processes = 64, iterations = 100000;
+    int pipefd[2];
+    int devfd;
+    unsigned long long start, elapsed, total_ns = 0, child_ns;
+    struct npheap_cmd cmd;
+    char *mapped_data;
+    pid_t pid;
+    int checksum;
+
+    if(argc != 3 && argc != 4)
+    {
+        fprintf(stderr, "Usage: %s number_of_processes iterations [checksum]\n",argv[0]);
+        exit(1);
+    }
+    number_of_processes = atoi(argv[1]);
+    iterations = atoi(argv[2]);
+    checksum = argc == 4 && strcmp(argv[3], "checksum") == 0;
+    devfd = open("/dev/npheap",O_RDWR);
+    if(devfd < 0 || pipe(pipefd) < 0)
+    {
+        fprintf(stderr, "Device open failed\n");
+        exit(1);
+    }
+
+    start = now_ns();
+    for(i = 0; i < number_of_processes; i++)
+    {
+        pid = fork();
+        if(pid == 0)
+        {
+            int j;
+            unsigned long long child_start = now_ns();
+            // Every process counts in its own object.
+            mapped_data = (char *)npheap_alloc(devfd,i+1,getpagesize());
+            if(mapped_data == MAP_FAILED)
+                exit(1);
+            if(checksum)
+                npheap_set_checksum(devfd,i+1,1);
+            cmd.offset = (i+1)*getpagesize();
+            for(j = 0; j < iterations; j++)
+            {
+                npheap_lock(devfd,i+1);
+                // Straight to the ioctl, npheap_getsize() skips it.
+                ioctl(devfd, NPHEAP_IOCTL_GETSIZE, &cmd);
+                mapped_data[j % getpagesize()]++;
+                npheap_unlock(devfd,i+1);
+            }
+            child_ns = now_ns() - child_start;
+            write(pipefd[1], &child_ns, sizeof(child_ns));
+            exit(0);
+        }
+    }
+    for(i = 0; i < number_of_processes; i++)
+    {
+        read(pipefd[0], &child_ns, sizeof(child_ns));
+        total_ns += child_ns;
+    }
+    while(wait(NULL) > 0)
+        ;
+    elapsed = now_ns() - start;
+
+    printf("%d processes x %d iterations in %llu ms\n", number_of_processes,
+           iterations, elapsed / 1000000);
+    printf("%.0f iterations/s, %.0f ns/iteration per process\n",
+           (double)number_of_processes * iterations * 1e9 / elapsed,
+           (double)total_ns / number_of_processes / iterations);
+    for(i = 0; i < number_of_processes; i++)
+        npheap_delete(devfd,i+1);
+    npheap_release(devfd);
+    close(devfd);
+    return 0;
+}
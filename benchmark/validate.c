@@ -84,6 +84,7 @@ int main(int argc, char *argv[])
     }
     if(error == 0)
         fprintf(stderr,"Pass\n");
+    npheap_release(devfd);
     close(devfd);
     return 0;
 }
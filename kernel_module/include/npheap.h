@@ -43,9 +43,127 @@ struct npheap_cmd {
     void *data;
 };
 
+struct npheap_clone_cmd {
+    __u64 src_offset;
+    __u64 dst_offset;
+};
+
+// Objects created by a 64-bit id rather than at an offset of their own
+// choosing are mapped at the offset the kernel hands back in token.
+struct npheap_id_cmd {
+    __u64 id;
+    __u64 size;
+    __u64 token;
+    __u64 flags;  // NPHEAP_CREATE_* for NPHEAP_IOCTL_CREATE
+};
+
+// Every mapping of the object gets all its pages mapped on its first fault
+// rather than each on first touch.
+#define NPHEAP_CREATE_PREFAULT 1
+
+// Objects can carry a tag, e.g. the job that owns them, to be acted on as
+// a group. offsets points to room for count offsets when listing.
+struct npheap_tag_cmd {
+    __u64 tag;
+    __u64 offset;
+    __u64 *offsets;
+    __u64 count;
+    __u64 bytes;
+};
+
+// Reading a snapshot fd yields one of these per object, followed by size
+// bytes of the object's data.
+struct npheap_record {
+    __u64 offset;
+    __u64 size;
+};
+
+// A checkpoint image is this header followed by a snapshot's records.
+#define NPHEAP_IMAGE_MAGIC  0x317650414548504eULL  // "NPHEAPv1"
+#define NPHEAP_IMAGE_VERSION  1
+
+struct npheap_image_header {
+    __u64 magic;
+    __u64 version;
+};
+
+// Mapping the device read-only at NPHEAP_DIR_OFFSET gives the metadata
+// directory: this header, then at entries_offset a hash table of nr_slots
+// (1 << shift) entries the kernel keeps current as objects come and go.
+// It sits just above the range the kernel hands out tokens from, where no
+// offset chosen by npheap_alloc() users reaches.
+#define NPHEAP_DIR_OFFSET  (1ULL << (sizeof(long) * 8 - 1))
+#define NPHEAP_DIR_MAGIC  0x5249445041454850ULL  // "PHEAPDIR"
+
+struct npheap_dir_header {
+    __u64 magic;
+    __u64 entries_offset;
+    __u64 nr_slots;
+    __u32 shift;
+    __u32 moves;  // odd while entries move, a lookup it changed under retries
+    __u64 missing;  // objects the table had no room for, ask the ioctl
+};
+
+#define NPHEAP_DIR_USED  1  // entry describes a live object
+#define NPHEAP_DIR_HAS_ID  4  // object was created by NPHEAP_IOCTL_CREATE
+
+// An entry is stable while seq is even and unchanged across the read.
+// version counts the changes made to the entry.
+struct npheap_dir_entry {
+    __u32 seq;
+    __u32 flags;
+    __u64 offset;
+    __u64 size;
+    __u64 version;
+};
+
+// Entry an offset is looked up from, probing linearly after it.
+static inline __u64 npheap_dir_slot(__u64 offset, __u32 shift)
+{
+    return (offset * 0x9e3779b97f4a7c15ULL) >> (64 - shift);
+}
+
 #define NPHEAP_IOCTL_LOCK  _IOWR('N', 0x43, struct npheap_cmd)
 #define NPHEAP_IOCTL_UNLOCK  _IOWR('N', 0x44, struct npheap_cmd)
 #define NPHEAP_IOCTL_DELETE  _IOWR('N', 0x45, struct npheap_cmd)
 #define NPHEAP_IOCTL_GETSIZE  _IOWR('N', 0x46, struct npheap_cmd)
+// Deletes every object in [offset, offset + size); returns the count.
+#define NPHEAP_IOCTL_DELETE_RANGE  _IOWR('N', 0x47, struct npheap_cmd)
+// Expires the object at offset size seconds from now (0 = never).
+#define NPHEAP_IOCTL_SET_TTL  _IOWR('N', 0x48, struct npheap_cmd)
+// Creates dst_offset as a copy-on-write clone of src_offset.
+#define NPHEAP_IOCTL_CLONE  _IOWR('N', 0x49, struct npheap_clone_cmd)
+// Returns a read-only fd holding a point-in-time image of the whole heap.
+#define NPHEAP_IOCTL_SNAPSHOT  _IO('N', 0x4a)
+// Restores the checkpoint image open at the fd passed by value as the argument.
+#define NPHEAP_IOCTL_RESTORE  _IO('N', 0x4b)
+// Copies the bitmap of pages of offset written since the last call to data
+// (size bytes) and clears it, returns the number of dirty pages.
+#define NPHEAP_IOCTL_GET_DIRTY  _IOWR('N', 0x4c, struct npheap_cmd)
+// Moves offset to the first object at or after it, returns its size or 0.
+// op is set to the object's generation, which differs between any two
+// objects ever created, so a deleted and recreated object can be told apart.
+#define NPHEAP_IOCTL_NEXT  _IOWR('N', 0x4d, struct npheap_cmd)
+// Creates the object id of size bytes unless it exists, then fills in its
+// token and size. flags are applied to the object either way.
+#define NPHEAP_IOCTL_CREATE  _IOWR('N', 0x4e, struct npheap_id_cmd)
+// Fills in the token and size of the existing object id.
+#define NPHEAP_IOCTL_LOOKUP  _IOWR('N', 0x4f, struct npheap_id_cmd)
+// Deletes the object id.
+#define NPHEAP_IOCTL_DELETE_ID  _IOWR('N', 0x50, struct npheap_id_cmd)
+// Checksums offset (crc32c) at every unlock naming it if size is 1, stops
+// if it is 0.
+#define NPHEAP_IOCTL_SET_CHECKSUM  _IOWR('N', 0x51, struct npheap_cmd)
+// Checks offset against its last checksum, fails with EBADMSG on mismatch.
+#define NPHEAP_IOCTL_VERIFY  _IOWR('N', 0x52, struct npheap_cmd)
+// Tags the object at offset with tag, 0 to untag it.
+#define NPHEAP_IOCTL_SET_TAG  _IOWR('N', 0x53, struct npheap_tag_cmd)
+// Copies the offsets of up to count objects tagged tag to offsets, in
+// offset order, sets count to how many there are, returns how many copied.
+#define NPHEAP_IOCTL_TAG_LIST  _IOWR('N', 0x54, struct npheap_tag_cmd)
+// Sets count and bytes to the number and total size of objects tagged tag.
+#define NPHEAP_IOCTL_TAG_GETSIZE  _IOWR('N', 0x55, struct npheap_tag_cmd)
+// Deletes every object tagged tag, returns the count.
+#define NPHEAP_IOCTL_TAG_DELETE  _IOWR('N', 0x56, struct npheap_tag_cmd)
 
 #endif
@@ -0,0 +1,74 @@
+//////////////////////////////////////////////////////////////////////
+//                             University of California, Riverside
+//
+//
+//
+//                             Copyright 2020
+//
+////////////////////////////////////////////////////////////////////////
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms and conditions of the GNU General Public License,
+// version 2, as published by the Free Software Foundation.
+//
+// This program is distributed in the hope it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+// more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+//
+////////////////////////////////////////////////////////////////////////
+//
+//   Authors:  Nicholas Kory
+//
+//   Description:
+//     How npheap.ko hands its objects over across a module reload
+//
+////////////////////////////////////////////////////////////////////////
+
+
+#ifndef _NPHEAP_HANDOFF_H
+#define _NPHEAP_HANDOFF_H
+
+#include <linux/types.h>
+#include <linux/mm_types.h>
+
+// Bump whenever the structures below change, an npheap.ko only adopts a
+// handoff of its own version.
+#define NPHEAP_HANDOFF_VERSION 7
+
+// One object as npheap.ko left it. Ownership of the pages, their
+// references and the arrays passes to whoever adopts it.
+struct npheap_parked_object {
+    unsigned long keystring;
+    __u64 size;
+    unsigned long nr_pages;
+    struct page **pages;  // kvmalloc'ed, null where never touched
+    unsigned long *cow;  // kvmalloc'ed copy-on-write bits
+    unsigned long *dirty;  // kvmalloc'ed pages written since last sync
+    unsigned long expires;  // second (jiffies / HZ) it expires, 0 for never
+    bool has_id;  // created by NPHEAP_IOCTL_CREATE
+    __u64 id;
+    bool checksummed;  // checksummed at every unlock naming it
+    bool crc_valid;
+    __u32 crc;
+    __u64 tag;  // 0 for none
+    bool prefault;  // created with NPHEAP_CREATE_PREFAULT
+};
+
+struct npheap_handoff {
+    unsigned int version;
+    unsigned long nr_objects;
+    struct npheap_parked_object objects[];  // kvmalloc'ed with the header
+};
+
+// Exported by npheap_handoff.ko, which stays loaded across npheap.ko
+// reloads. npheap.ko looks them up with symbol_get() so it still loads
+// without it.
+void npheap_handoff_park(struct npheap_handoff *handoff);
+struct npheap_handoff *npheap_handoff_take(void);
+
+#endif
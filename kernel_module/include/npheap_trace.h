@@ -0,0 +1,174 @@
+//////////////////////////////////////////////////////////////////////
+//                             University of California, Riverside
+//
+//
+//
+//                             Copyright 2020
+//
+////////////////////////////////////////////////////////////////////////
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms and conditions of the GNU General Public License,
+// version 2, as published by the Free Software Foundation.
+//
+// This program is distributed in the hope it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+// more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+//
+////////////////////////////////////////////////////////////////////////
+//
+//   Authors:  Nicholas Kory
+//
+//   Description:
+//     Tracepoints of npheap.ko
+//
+////////////////////////////////////////////////////////////////////////
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM npheap
+
+#if !defined(_NPHEAP_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _NPHEAP_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/sched.h>
+
+// An operation on one object. latency is how long it took in ns.
+DECLARE_EVENT_CLASS(npheap_object,
+
+  TP_PROTO(u64 offset, u64 size, u64 latency),
+
+  TP_ARGS(offset, size, latency),
+
+  TP_STRUCT__entry(
+    __field(u64, offset)
+    __field(u64, size)
+    __field(pid_t, pid)
+    __field(u64, latency)
+  ),
+
+  TP_fast_assign(
+    __entry->offset = offset;
+    __entry->size = size;
+    __entry->pid = current->tgid;
+    __entry->latency = latency;
+  ),
+
+  TP_printk("offset=%llu size=%llu pid=%d latency=%llu",
+            __entry->offset, __entry->size, __entry->pid, __entry->latency)
+);
+
+// An object is created by mmap, clone or NPHEAP_IOCTL_CREATE.
+DEFINE_EVENT(npheap_object, npheap_create,
+  TP_PROTO(u64 offset, u64 size, u64 latency),
+  TP_ARGS(offset, size, latency)
+);
+
+// An object is mapped, whether or not it had to be created.
+DEFINE_EVENT(npheap_object, npheap_map,
+  TP_PROTO(u64 offset, u64 size, u64 latency),
+  TP_ARGS(offset, size, latency)
+);
+
+// NPHEAP_IOCTL_GETSIZE looked up an object, size is 0 if there was none.
+DEFINE_EVENT(npheap_object, npheap_getsize,
+  TP_PROTO(u64 offset, u64 size, u64 latency),
+  TP_ARGS(offset, size, latency)
+);
+
+// An object is deleted by NPHEAP_IOCTL_DELETE or DELETE_ID.
+DEFINE_EVENT(npheap_object, npheap_delete,
+  TP_PROTO(u64 offset, u64 size, u64 latency),
+  TP_ARGS(offset, size, latency)
+);
+
+// The heap lock was taken when a process asked for it.
+TRACE_EVENT(npheap_lock_contend,
+
+  TP_PROTO(pid_t holder),
+
+  TP_ARGS(holder),
+
+  TP_STRUCT__entry(
+    __field(pid_t, pid)
+    __field(pid_t, holder)
+  ),
+
+  TP_fast_assign(
+    __entry->pid = current->tgid;
+    __entry->holder = holder;
+  ),
+
+  TP_printk("pid=%d holder=%d", __entry->pid, __entry->holder)
+);
+
+// The heap lock was acquired after waiting wait ns, or released after
+// being held for hold ns.
+DECLARE_EVENT_CLASS(npheap_lock,
+
+  TP_PROTO(u64 ns),
+
+  TP_ARGS(ns),
+
+  TP_STRUCT__entry(
+    __field(pid_t, pid)
+    __field(u64, ns)
+  ),
+
+  TP_fast_assign(
+    __entry->pid = current->tgid;
+    __entry->ns = ns;
+  ),
+
+  TP_printk("pid=%d ns=%llu", __entry->pid, __entry->ns)
+);
+
+DEFINE_EVENT(npheap_lock, npheap_lock_acquire,
+  TP_PROTO(u64 wait),
+  TP_ARGS(wait)
+);
+
+DEFINE_EVENT(npheap_lock, npheap_lock_release,
+  TP_PROTO(u64 hold),
+  TP_ARGS(hold)
+);
+
+// The heap lock was held for longer than hold_warn_ms. offset is the one
+// named by the holder's NPHEAP_IOCTL_LOCK command.
+TRACE_EVENT(npheap_lock_held_long,
+
+  TP_PROTO(pid_t holder, const char *comm, u64 offset, u64 hold),
+
+  TP_ARGS(holder, comm, offset, hold),
+
+  TP_STRUCT__entry(
+    __field(pid_t, holder)
+    __array(char, comm, TASK_COMM_LEN)
+    __field(u64, offset)
+    __field(u64, hold)
+  ),
+
+  TP_fast_assign(
+    __entry->holder = holder;
+    memcpy(__entry->comm, comm, TASK_COMM_LEN);
+    __entry->offset = offset;
+    __entry->hold = hold;
+  ),
+
+  TP_printk("holder=%d comm=%s offset=%llu hold=%llu",
+            __entry->holder, __entry->comm, __entry->offset, __entry->hold)
+);
+
+#endif
+
+// Found through the include path, see ccflags-y in Kbuild.
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE npheap_trace
+#include <trace/define_trace.h>
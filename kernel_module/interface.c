@@ -49,6 +49,8 @@ extern long npheap_lock(struct npheap_cmd __user *user_cmd);
 extern long npheap_unlock(struct npheap_cmd __user *user_cmd);
 extern long npheap_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
 extern int npheap_mmap(struct file *filp, struct vm_area_struct *vma);
+extern int npheap_fadvise(struct file *filp, loff_t offset, loff_t len,
+                          int advice);
 extern int npheap_init(void);
 extern void npheap_exit(void);
 
@@ -56,6 +58,7 @@ static const struct file_operations npheap_fops = {
     .owner                = THIS_MODULE,
     .unlocked_ioctl       = npheap_ioctl,
     .mmap                 = npheap_mmap,
+    .fadvise              = npheap_fadvise,
 };
 
 struct miscdevice npheap_dev = {
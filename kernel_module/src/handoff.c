@@ -0,0 +1,121 @@
+//////////////////////////////////////////////////////////////////////
+//                             University of California, Riverside
+//
+//
+//
+//                             Copyright 2020
+//
+////////////////////////////////////////////////////////////////////////
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms and conditions of the GNU General Public License,
+// version 2, as published by the Free Software Foundation.
+//
+// This program is distributed in the hope it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+// more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+//
+////////////////////////////////////////////////////////////////////////
+//
+//   Authors:  Nicholas Kory
+//
+//   Description:
+//     Keeps npheap.ko's objects alive while the module is reloaded
+//
+////////////////////////////////////////////////////////////////////////
+
+
+#include "npheap_handoff.h"
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/bitmap.h>
+#include <linux/atomic.h>
+
+// The handoff left by the last npheap.ko to unload, if nobody took it yet.
+static struct npheap_handoff *parked;
+
+
+// npheap_handoff_release() frees a handoff nobody is going to adopt.
+//
+// handoff: the handoff to free
+//
+// returns: void
+static void npheap_handoff_release(struct npheap_handoff *handoff)
+{
+  unsigned long i, j;
+
+  if (handoff->version != NPHEAP_HANDOFF_VERSION) {
+    printk(KERN_ERR "npheap_handoff: leaking handoff of version %u\n",
+           handoff->version);
+    return;
+  }
+  for (i = 0; i < handoff->nr_objects; i++) {
+    struct npheap_parked_object *obj = &handoff->objects[i];
+
+    for (j = 0; j < obj->nr_pages; j++)
+      if (obj->pages[j])
+        put_page(obj->pages[j]);
+    kvfree(obj->pages);
+    kvfree(obj->cow);
+    kvfree(obj->dirty);
+  }
+  kvfree(handoff);
+}  //npheap_handoff_release()
+
+
+// npheap_handoff_park() keeps an unloading npheap.ko's objects. A handoff
+// that was never taken is replaced.
+//
+// handoff: the objects to keep
+//
+// returns: void
+void npheap_handoff_park(struct npheap_handoff *handoff)
+{
+  struct npheap_handoff *old = xchg(&parked, handoff);
+
+  if (old)
+    npheap_handoff_release(old);
+  printk(KERN_INFO "npheap_handoff: parked %lu objects\n",
+         handoff->nr_objects);
+}  //npheap_handoff_park()
+EXPORT_SYMBOL_GPL(npheap_handoff_park);
+
+
+// npheap_handoff_take() gives the parked objects to a loading npheap.ko.
+//
+// returns: the handoff or null if there is none
+struct npheap_handoff *npheap_handoff_take(void)
+{
+  return xchg(&parked, NULL);
+}  //npheap_handoff_take()
+EXPORT_SYMBOL_GPL(npheap_handoff_take);
+
+
+static int __init npheap_handoff_init(void)
+{
+  return 0;
+}
+
+
+static void __exit npheap_handoff_exit(void)
+{
+  struct npheap_handoff *old = xchg(&parked, NULL);
+
+  if (old)
+    npheap_handoff_release(old);
+}
+
+
+MODULE_AUTHOR("Nicholas Kory");
+MODULE_LICENSE("GPL");
+MODULE_VERSION("0.1");
+module_init(npheap_handoff_init);
+module_exit(npheap_handoff_exit);
@@ -30,6 +30,7 @@
 ////////////////////////////////////////////////////////////////////////
 
 #include "npheap.h"
+#include "npheap_handoff.h"
 
 #include <asm/processor.h>
 #include <asm/segment.h>
@@ -44,6 +45,33 @@
 #include <linux/poll.h>
 #include <linux/mutex.h>
 #include <linux/rbtree.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/jiffies.h>
+#include <linux/highmem.h>
+#include <linux/bitmap.h>
+#include <linux/anon_inodes.h>
+#include <linux/file.h>
+#include <linux/kref.h>
+#include <linux/rwsem.h>
+#include <linux/ktime.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/atomic.h>
+#include <linux/sched.h>
+#include <linux/pid.h>
+#include <linux/pid_namespace.h>
+#include <linux/percpu.h>
+#include <linux/jump_label.h>
+#include <linux/crc32c.h>
+#include <linux/fadvise.h>
+#include <linux/overflow.h>
+
+#define CREATE_TRACE_POINTS
+#include "npheap_trace.h"
 
 ////////////////////////////////////////////////////////////////////////
 //
@@ -60,6 +88,237 @@ static DEFINE_MUTEX(np_lock);
 // The root node for the rb tree data structure.
 struct rb_root mytree = RB_ROOT;
 
+// Guards mytree and the expiry wheel against the kernel's own workers,
+// which run whether or not a user process holds np_lock.
+static DEFINE_MUTEX(tree_lock);
+
+// Objects created by id, keyed by that id. Guarded by tree_lock too.
+static struct rb_root idtree = RB_ROOT;
+
+// Tagged objects, ordered by tag and then key. Guarded by tree_lock too.
+static struct rb_root tagtree = RB_ROOT;
+
+// Keys handed out as mapping tokens for objects created by id, from a range
+// well above the offsets npheap_alloc() users pick. next_token is the next
+// one to try.
+#define NPHEAP_TOKEN_FIRST (1UL << (BITS_PER_LONG - PAGE_SHIFT - 2))
+#define NPHEAP_TOKEN_LAST (NPHEAP_TOKEN_FIRST * 2 - 1)
+static unsigned long next_token = NPHEAP_TOKEN_FIRST;
+
+// Last generation handed to an object put in mytree, guarded by tree_lock.
+// Seeded from the clock at load so generations stay unique across module
+// reloads as well.
+static u64 generation;
+
+// The device's address space, used to shoot down stale page table entries
+// once an object's page goes away or becomes copy-on-write.
+static struct address_space *npheap_mapping;
+
+// Held for reading by faults and for writing while a snapshot freezes the
+// heap, so no write lands between the first and the last object copied.
+static DECLARE_RWSEM(freeze_sem);
+
+// Nodes out of mytree and unmapped that npheap_free_work() still has to
+// free. Guarded by free_lock so deleters never wait on the allocator.
+static LIST_HEAD(free_list);
+static DEFINE_SPINLOCK(free_lock);
+static void npheap_free_work(struct work_struct *work);
+static DECLARE_WORK(free_work, npheap_free_work);
+
+// Seconds to live given to every new object, 0 to keep objects forever.
+static unsigned int default_ttl;
+module_param(default_ttl, uint, 0644);
+MODULE_PARM_DESC(default_ttl, "Seconds before a new object expires (0 = never)");
+
+// Limits on new objects, 0 for none. Like every 0644 parameter they can be
+// changed through /sys/module/npheap/parameters while the heap is in use;
+// lowering one keeps the objects already there.
+static unsigned long max_object_size;
+module_param(max_object_size, ulong, 0644);
+MODULE_PARM_DESC(max_object_size, "Largest object in bytes (0 = no limit)");
+static unsigned long max_heap_bytes;
+module_param(max_heap_bytes, ulong, 0644);
+MODULE_PARM_DESC(max_heap_bytes, "Bytes of objects in the heap (0 = no limit)");
+
+// No object is ever larger, so its page count can't wrap.
+#define NPHEAP_SIZE_MAX (ULONG_MAX >> 1)
+
+// Hashed timer wheel of objects with an expiry time, one slot per second.
+// Objects due further out than the wheel spans simply wait out extra laps.
+#define NPHEAP_TTL_SLOTS 256
+// Longer times to live are cut to this, which is still decades and can't
+// make the expiry second wrap.
+#define NPHEAP_TTL_MAX (ULONG_MAX / 4)
+static struct list_head ttl_wheel[NPHEAP_TTL_SLOTS];
+static unsigned long ttl_count;  //objects on the wheel
+static unsigned long ttl_clock;  //last second swept by npheap_ttl_work()
+// Sweeps skipped in a row because the heap was locked. After this many
+// the sweep waits for the lock, so a busy heap can't hold off expiry.
+#define NPHEAP_TTL_MAX_MISSES 10
+static unsigned int ttl_misses;
+static void npheap_ttl_work(struct work_struct *work);
+static DECLARE_DELAYED_WORK(ttl_work, npheap_ttl_work);
+
+// Metadata directory users map read-only at NPHEAP_DIR_OFFSET to look up
+// object sizes without a syscall, null if it could not be allocated. Only
+// written under tree_lock.
+static struct npheap_dir_header *dir;
+static struct npheap_dir_entry *dir_entries;
+static unsigned long dir_pages;
+static unsigned long dir_used;  //entries in use, one is always left empty
+static unsigned int dir_slots = 65536;
+module_param(dir_slots, uint, 0444);
+MODULE_PARM_DESC(dir_slots, "Entries in the mapped metadata directory");
+
+// Image written by npheap_checkpoint() to restore while loading the module.
+static char *restore;
+module_param(restore, charp, 0444);
+MODULE_PARM_DESC(restore, "Checkpoint image to restore at load");
+
+// Workers reading an image in parallel, 0 for one per online cpu.
+static unsigned int restore_workers;
+module_param(restore_workers, uint, 0644);
+MODULE_PARM_DESC(restore_workers, "Parallel restore workers (0 = one per cpu)");
+
+// Counters and histograms can be switched off at runtime, which patches
+// them out of the fast paths, to measure what they cost.
+static DEFINE_STATIC_KEY_TRUE(stats_enabled);
+static bool stats = true;
+
+static int npheap_stats_set(const char *val, const struct kernel_param *kp)
+{
+  int ret = param_set_bool(val, kp);
+
+  if (!ret) {
+    if (stats)
+      static_branch_enable(&stats_enabled);
+    else
+      static_branch_disable(&stats_enabled);
+  }
+  return ret;
+}
+
+static const struct kernel_param_ops npheap_stats_ops = {
+  .set = npheap_stats_set,
+  .get = param_get_bool,
+};
+module_param_cb(stats, &npheap_stats_ops, &stats, 0644);
+MODULE_PARM_DESC(stats, "Keep operation counters and latency histograms");
+
+// Synthetic objects to time the index and allocator with at load, 0 to
+// skip it.
+static unsigned int selftest;
+module_param(selftest, uint, 0444);
+MODULE_PARM_DESC(selftest, "Objects to time the index with at load (0 = off)");
+
+// Operation and byte counters exported through debugfs, see
+// npheap_ops_show(). Per cpu so counting never bounces a cache line.
+enum npheap_stat {
+  NPHEAP_STAT_LOCK,
+  NPHEAP_STAT_UNLOCK,
+  NPHEAP_STAT_GETSIZE,
+  NPHEAP_STAT_DELETE,
+  NPHEAP_STAT_MMAP,
+  NPHEAP_STAT_CREATE,
+  NPHEAP_STAT_EXPIRE,
+  NPHEAP_STAT_ALLOC_FAIL,
+  NPHEAP_STAT_FAULT,
+  NPHEAP_STAT_BYTES_CREATED,
+  NPHEAP_STAT_BYTES_DELETED,
+  NPHEAP_STAT_PREFAULT,
+  NPHEAP_NR_STATS
+};
+struct npheap_stats {
+  u64 count[NPHEAP_NR_STATS];
+};
+static DEFINE_PER_CPU(struct npheap_stats, op_stats);
+
+static inline void npheap_count_add(enum npheap_stat stat, u64 n)
+{
+  if (static_branch_likely(&stats_enabled))
+    this_cpu_add(op_stats.count[stat], n);
+}
+
+static inline void npheap_count(enum npheap_stat stat)
+{
+  npheap_count_add(stat, 1);
+}
+
+// Live objects and their bytes, in total and by size class, a class being
+// objects of [2^i, 2^(i+1)) pages. Guarded by tree_lock.
+#define NPHEAP_SIZE_CLASSES 32
+static unsigned long nr_objects;
+static u64 nr_bytes;
+static unsigned long class_objects[NPHEAP_SIZE_CLASSES];
+static u64 class_bytes[NPHEAP_SIZE_CLASSES];
+
+// Per-cpu latency histograms exported through debugfs. Bucket i counts
+// latencies of [2^i, 2^(i+1)) ns, bucket 0 also those under 1 ns.
+#define NPHEAP_HIST_BUCKETS 64
+enum npheap_hist {
+  NPHEAP_HIST_LOCK_WAIT,
+  NPHEAP_HIST_LOCK_HOLD,
+  NPHEAP_HIST_MMAP,
+  NPHEAP_HIST_CREATE,
+  NPHEAP_HIST_DELETE,
+  NPHEAP_HIST_CHECKSUM,
+  NPHEAP_NR_HISTS
+};
+struct npheap_hists {
+  u64 buckets[NPHEAP_NR_HISTS][NPHEAP_HIST_BUCKETS];
+};
+static DEFINE_PER_CPU(struct npheap_hists, hists);
+
+static inline void npheap_hist_add(enum npheap_hist hist, u64 ns)
+{
+  if (static_branch_likely(&stats_enabled))
+    this_cpu_inc(hists.buckets[hist][ns ? ilog2(ns) : 0]);
+}
+
+// Locks and faults are attributed to their object once every heat_sample
+// times per cpu, 0 turns that off.
+static unsigned int heat_sample = 16;
+module_param(heat_sample, uint, 0644);
+MODULE_PARM_DESC(heat_sample, "Hot key sampling period (0 = off)");
+static DEFINE_PER_CPU(unsigned int, heat_tick);
+
+static inline bool npheap_sampled(void)
+{
+  unsigned int rate = READ_ONCE(heat_sample);
+
+  return rate && this_cpu_inc_return(heat_tick) % rate == 0;
+}
+
+// Objects listed in debugfs hot_keys.
+#define NPHEAP_HOT_KEYS 16
+
+// Who holds np_lock, 0 when it is free, since when in ns, how long it
+// waited for it and the offset its command named. Written by the holder,
+// holder_lock keeps readers from seeing it half written.
+static DEFINE_SPINLOCK(holder_lock);
+static pid_t lock_holder;
+static u64 lock_acquired;
+static u64 lock_wait;
+static bool lock_contended;
+static __u64 lock_offset;
+static bool lock_named;  //whether lock_offset was read, see npheap_lock()
+static bool lock_sampled;  //whether the lock counts towards hot_keys
+static bool lock_reported;  //whether the hold was reported as too long
+
+// Objects checksummed at unlock, under tree_lock. Unless there are any,
+// only sampled locks look up the object they name.
+static unsigned long nr_checksummed;
+
+// Holding the heap lock longer than this many ms is reported, 0 for never.
+static unsigned int hold_warn_ms = 1000;
+module_param(hold_warn_ms, uint, 0644);
+MODULE_PARM_DESC(hold_warn_ms,
+                 "Report heap lock holds longer than this (ms, 0 = off)");
+static void npheap_hold_work(struct work_struct *work);
+static DECLARE_DELAYED_WORK(hold_work, npheap_hold_work);
+
+static struct dentry *debugfs_dir;
+
 ////////////////////////////////////////////////////////////////////////
 //
 //   Red black tree data structure implementation.
@@ -73,6 +332,32 @@ struct mytype {
   	struct rb_node node;
   	unsigned long keystring;  //use offset for keystring
     struct npheap_cmd node_cmd;  //data for NPHeap
+    struct kref ref;  //one for being in mytree, one per mapping
+    struct mutex lock;  //guards pages, cow and dirty
+    struct page **pages;  //backing pages, allocated on first touch
+    unsigned long nr_pages;
+    unsigned long *cow;  //pages shared with a clone, copied on first write
+    unsigned long *dirty;  //pages written since the last npheap_get_dirty()
+    struct list_head free_entry;  //link on free_list once erased
+    unsigned long expires;  //second (jiffies / HZ) it expires, 0 for never
+    struct list_head ttl_entry;  //link on its ttl_wheel slot
+    bool has_id;  //created by npheap_create(), also in idtree
+    u64 id;
+    struct rb_node id_node;  //link in idtree
+    long dir_slot;  //its entry in dir, -1 if the directory was full
+    atomic_t locks;  //sampled locks taken naming it
+    atomic_t contended;  //sampled locks naming it that had to wait
+    atomic_t faults;  //sampled page faults on it
+    unsigned long last_access;  //jiffies of its last lock or sampled fault
+    u64 wait_ns;  //time sampled locks naming it waited, under tree_lock
+    u64 hold_ns;  //time sampled locks naming it were held, under tree_lock
+    bool checksummed;  //crc is taken at every unlock naming it
+    bool crc_valid;  //crc was taken since checksumming was turned on
+    u32 crc;  //crc32c of its data, under lock
+    u64 tag;  //0 for none, otherwise it is in tagtree
+    struct rb_node tag_node;  //link in tagtree
+    u64 generation;  //tells it from an earlier object at the same offset
+    bool prefault;  //every mapping of it is populated on its first fault
   }; //struct mytype
 
 
@@ -118,39 +403,1916 @@ int my_insert(struct rb_root *root, struct mytype *data)
     struct mytype *this = container_of(*new, struct mytype, node);
     long long result = data->keystring - this->keystring;
 
-  parent = *new;
-    if (result < 0)
-      new = &((*new)->rb_left);
-    else if (result > 0)
-      new = &((*new)->rb_right);
-    else
-      return 0;
+  parent = *new;
+    if (result < 0)
+      new = &((*new)->rb_left);
+    else if (result > 0)
+      new = &((*new)->rb_right);
+    else
+      return 0;
+  }
+
+  // Add new node and rebalance tree.
+  rb_link_node(&data->node, parent, new);
+  rb_insert_color(&data->node, root);
+
+return 1;
+}  //my_insert()
+
+
+// my_search_from() finds the first node whose key is not below keystring.
+//
+// rb_root: the rb tree rb_root
+// keystring: the lowest key we're interested in
+//
+// returns: the first node at or after keystring or null if there is none
+struct mytype *my_search_from(struct rb_root *root, unsigned long keystring)
+{
+  struct rb_node *node = root->rb_node;
+  struct mytype *found = NULL;
+
+  while (node) {
+    struct mytype *data = container_of(node, struct mytype, node);
+
+    if (keystring <= data->keystring) {
+      found = data;
+      node = node->rb_left;
+    }
+    else
+      node = node->rb_right;
+  }
+  return found;
+}  //my_search_from()
+
+
+// npheap_id_search() searches idtree for the node created with an id.
+//
+// root: the idtree rb_root
+// id: the id we're searching for
+//
+// returns: the node we're looking for if found or null if not found
+static struct mytype *npheap_id_search(struct rb_root *root, u64 id)
+{
+  struct rb_node *node = root->rb_node;
+
+  while (node) {
+    struct mytype *data = container_of(node, struct mytype, id_node);
+
+    // Compare rather than subtract, ids use all 64 bits.
+    if (id < data->id)
+      node = node->rb_left;
+    else if (id > data->id)
+      node = node->rb_right;
+    else
+      return data;
+  }
+  return NULL;
+}  //npheap_id_search()
+
+
+// npheap_id_insert() inserts a node into idtree by its id.
+//
+// root: the idtree rb_root
+// data: the node we're inserting
+//
+// returns: 1 if successful or 0 if the id is already in idtree
+static int npheap_id_insert(struct rb_root *root, struct mytype *data)
+{
+  struct rb_node **new = &(root->rb_node), *parent = NULL;
+
+  while (*new) {
+    struct mytype *this = container_of(*new, struct mytype, id_node);
+
+    parent = *new;
+    if (data->id < this->id)
+      new = &((*new)->rb_left);
+    else if (data->id > this->id)
+      new = &((*new)->rb_right);
+    else
+      return 0;
+  }
+
+  rb_link_node(&data->id_node, parent, new);
+  rb_insert_color(&data->id_node, root);
+  return 1;
+}  //npheap_id_insert()
+
+
+// npheap_tag_cmp() orders a tag and key against a node in tagtree.
+//
+// tag: the tag
+// keystring: the key
+// node: the node to compare with
+//
+// returns: <0, 0 or >0 as tag and keystring order before, with or after node
+static int npheap_tag_cmp(u64 tag, unsigned long keystring,
+                          struct mytype *node)
+{
+  if (tag != node->tag)
+    return tag < node->tag ? -1 : 1;
+  if (keystring != node->keystring)
+    return keystring < node->keystring ? -1 : 1;
+  return 0;
+}  //npheap_tag_cmp()
+
+
+// npheap_tag_insert() inserts a tagged node into tagtree.
+//
+// root: the tagtree rb_root
+// data: the node we're inserting, its tag already set
+//
+// returns: void
+static void npheap_tag_insert(struct rb_root *root, struct mytype *data)
+{
+  struct rb_node **new = &(root->rb_node), *parent = NULL;
+
+  while (*new) {
+    struct mytype *this = container_of(*new, struct mytype, tag_node);
+
+    parent = *new;
+    if (npheap_tag_cmp(data->tag, data->keystring, this) < 0)
+      new = &((*new)->rb_left);
+    else
+      new = &((*new)->rb_right);
+  }
+
+  rb_link_node(&data->tag_node, parent, new);
+  rb_insert_color(&data->tag_node, root);
+}  //npheap_tag_insert()
+
+
+// npheap_tag_first() finds the tagged node with the lowest key.
+//
+// root: the tagtree rb_root
+// tag: the tag we're searching for
+//
+// returns: the first node with the tag or null if there is none
+static struct mytype *npheap_tag_first(struct rb_root *root, u64 tag)
+{
+  struct rb_node *node = root->rb_node;
+  struct mytype *found = NULL;
+
+  while (node) {
+    struct mytype *data = container_of(node, struct mytype, tag_node);
+
+    if (npheap_tag_cmp(tag, 0, data) <= 0) {
+      found = data;
+      node = node->rb_left;
+    }
+    else
+      node = node->rb_right;
+  }
+  return found && found->tag == tag ? found : NULL;
+}  //npheap_tag_first()
+
+
+// npheap_tag_next() steps to the next node with the same tag.
+//
+// node: a node in tagtree
+//
+// returns: the next node with node's tag or null if there is none
+static struct mytype *npheap_tag_next(struct mytype *node)
+{
+  struct mytype *next = rb_entry_safe(rb_next(&node->tag_node),
+                                      struct mytype, tag_node);
+
+  return next && next->tag == node->tag ? next : NULL;
+}  //npheap_tag_next()
+
+
+// rb_erase() is part of linux/rbtree.h.
+//
+// victim: node to be removed (found using search)
+// rb_root: the rb tree rb_root
+//
+// return: void
+//  void rb_erase(struct rb_node *victim, struct rb_root *tree);
+//
+// Example:
+//
+//   struct mytype *data = mysearch(mytree, "walrus");
+//
+//   if (data) {
+//   	rb_erase(data->node, mytree);
+//   	myfree(data);
+//   }
+
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Object pages.
+//
+////////////////////////////////////////////////////////////////////////
+
+// npheap_bitmap_alloc() allocates a zeroed bitmap of nbits, falling back
+// to vmalloc so a large object's bitmaps never need contiguous pages.
+//
+// nbits: the number of bits
+//
+// returns: the bitmap, to be freed with kvfree(), or null
+static unsigned long *npheap_bitmap_alloc(unsigned long nbits)
+{
+  return kvcalloc(BITS_TO_LONGS(nbits), sizeof(unsigned long), GFP_KERNEL);
+}  //npheap_bitmap_alloc()
+
+
+// npheap_new_node() allocates a node with room for size bytes of pages.
+// Nothing in it needs more than an order-0 allocation, so creating objects
+// keeps working however fragmented memory gets.
+//
+// keystring: the key of the new node
+// size: the object size in bytes
+//
+// returns: the new node or null if we're out of memory
+static struct mytype *npheap_new_node(unsigned long keystring,
+                                      unsigned long size)
+{
+  struct mytype *node = kzalloc(sizeof(struct mytype), GFP_KERNEL);
+
+  if (!node) {
+    npheap_count(NPHEAP_STAT_ALLOC_FAIL);
+    return NULL;
+  }
+
+  node->keystring = keystring;
+  node->node_cmd.offset = keystring;
+  node->node_cmd.size = size;
+  node->nr_pages = DIV_ROUND_UP(size, PAGE_SIZE);
+  node->pages = kvcalloc(node->nr_pages, sizeof(struct page *), GFP_KERNEL);
+  node->cow = npheap_bitmap_alloc(node->nr_pages);
+  node->dirty = npheap_bitmap_alloc(node->nr_pages);
+  kref_init(&node->ref);
+  mutex_init(&node->lock);
+  INIT_LIST_HEAD(&node->ttl_entry);
+  if (!node->pages || !node->cow || !node->dirty) {
+    npheap_count(NPHEAP_STAT_ALLOC_FAIL);
+    kvfree(node->pages);
+    kvfree(node->cow);
+    kvfree(node->dirty);
+    kfree(node);
+    return NULL;
+  }
+  return node;
+}  //npheap_new_node()
+
+
+// npheap_free_node() drops a node's pages and frees it. The node must be
+// out of mytree and no longer mapped anywhere, see npheap_put().
+//
+// node: the node to free
+//
+// returns: void
+static void npheap_free_node(struct mytype *node)
+{
+  unsigned long i, nr = 0;
+
+  // Pack the populated pages so they go back in one release_pages() pass.
+  for (i = 0; i < node->nr_pages; i++)
+    if (node->pages[i])
+      node->pages[nr++] = node->pages[i];
+  release_pages(node->pages, nr);
+  kvfree(node->pages);
+  kvfree(node->cow);
+  kvfree(node->dirty);
+  kfree(node);
+}  //npheap_free_node()
+
+
+// npheap_zap() removes every user mapping of a run of a node's pages, so
+// the next access faults and sees the node's current pages.
+//
+// node: the node whose pages are unmapped
+// first: index of the first page
+// nr: number of pages
+//
+// returns: void
+static void npheap_zap(struct mytype *node, unsigned long first,
+                       unsigned long nr)
+{
+  struct address_space *mapping = READ_ONCE(npheap_mapping);
+
+  if (mapping)
+    unmap_mapping_range(mapping,
+                        (loff_t)(node->keystring + first) << PAGE_SHIFT,
+                        (loff_t)nr << PAGE_SHIFT, 1);
+}  //npheap_zap()
+
+
+// npheap_split_page() gives a node a private copy of a page it shares with
+// a clone. Caller holds node->lock.
+//
+// node: the node that is about to write the page
+// idx: index of the page
+//
+// returns: 0 if successful or -ENOMEM
+static int npheap_split_page(struct mytype *node, unsigned long idx)
+{
+  struct page *old = node->pages[idx];
+  struct page *new = alloc_page(GFP_HIGHUSER);
+
+  if (!new) {
+    npheap_count(NPHEAP_STAT_ALLOC_FAIL);
+    return -ENOMEM;
+  }
+
+  copy_highpage(new, old);
+  node->pages[idx] = new;
+  clear_bit(idx, node->cow);
+
+  // Mappings don't hold page references, so unmap before letting go.
+  npheap_zap(node, idx, 1);
+  put_page(old);
+  return 0;
+}  //npheap_split_page()
+
+
+// npheap_cow_reuse() lets a node keep writing a copy-on-write page in place
+// once the clone or snapshot it was shared with has let go of it. Sharing
+// happens under the sharing node's lock, so nothing can take a new
+// reference meanwhile. Caller holds node->lock.
+//
+// node: the node that is about to write the page
+// idx: index of the page
+//
+// returns: true if the page is no longer shared and its cow bit was cleared
+static bool npheap_cow_reuse(struct mytype *node, unsigned long idx)
+{
+  if (page_count(node->pages[idx]) != 1)
+    return false;
+  clear_bit(idx, node->cow);
+  return true;
+}  //npheap_cow_reuse()
+
+
+// npheap_get_page() returns the page to map at idx, allocating it on first
+// touch and un-sharing it and marking it dirty on write. Caller holds
+// node->lock.
+//
+// node: the node being faulted on
+// idx: index of the page
+// write: whether the page is about to be written
+//
+// returns: the page or null if we're out of memory
+static struct page *npheap_get_page(struct mytype *node, unsigned long idx,
+                                    bool write)
+{
+  if (!node->pages[idx]) {
+    node->pages[idx] = alloc_page(GFP_HIGHUSER | __GFP_ZERO);
+    if (!node->pages[idx])
+      npheap_count(NPHEAP_STAT_ALLOC_FAIL);
+  }
+  else if (write && test_bit(idx, node->cow) &&
+           !npheap_cow_reuse(node, idx) && npheap_split_page(node, idx))
+    return NULL;
+  if (write && node->pages[idx])
+    set_bit(idx, node->dirty);
+  return node->pages[idx];
+}  //npheap_get_page()
+
+
+// npheap_share_pages() makes dst share every populated page of src, each
+// side copying a shared page on its first write. Caller holds src->lock.
+//
+// src: the node whose pages are shared
+// dst: a fresh node of the same size
+//
+// returns: void
+static void npheap_share_pages(struct mytype *src, struct mytype *dst)
+{
+  unsigned long i;
+
+  for (i = 0; i < src->nr_pages; i++) {
+    if (!src->pages[i])
+      continue;
+    get_page(src->pages[i]);
+    dst->pages[i] = src->pages[i];
+    set_bit(i, src->cow);
+    set_bit(i, dst->cow);
+  }
+}  //npheap_share_pages()
+
+
+// npheap_checksum() computes the crc32c of a node's data, pages never
+// touched counting as zeroes. crc32c() uses the crypto API, so it runs on
+// the cpu's crc32 instructions where there are any. Caller holds
+// node->lock.
+//
+// node: the node to checksum
+//
+// returns: the crc32c
+static u32 npheap_checksum(struct mytype *node)
+{
+  u64 start = ktime_get_ns();
+  u64 left = node->node_cmd.size;
+  unsigned long i;
+  u32 crc = ~0;
+
+  for (i = 0; i < node->nr_pages; i++) {
+    size_t len = min_t(u64, left, PAGE_SIZE);
+
+    if (node->pages[i]) {
+      void *addr = kmap(node->pages[i]);
+
+      crc = crc32c(crc, addr, len);
+      kunmap(node->pages[i]);
+    }
+    else
+      crc = crc32c(crc, page_address(ZERO_PAGE(0)), len);
+    left -= len;
+    cond_resched();
+  }
+  npheap_hist_add(NPHEAP_HIST_CHECKSUM, ktime_get_ns() - start);
+  return ~crc;
+}  //npheap_checksum()
+
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Deferred freeing.
+//
+////////////////////////////////////////////////////////////////////////
+
+// npheap_release() queues a node that is out of mytree and unmapped for
+// npheap_free_work(), so dropping the last reference never waits on the
+// allocator however big the node is.
+//
+// ref: the node's ref
+//
+// returns: void
+static void npheap_release(struct kref *ref)
+{
+  struct mytype *node = container_of(ref, struct mytype, ref);
+
+  spin_lock(&free_lock);
+  list_add_tail(&node->free_entry, &free_list);
+  spin_unlock(&free_lock);
+  queue_work(system_unbound_wq, &free_work);
+}  //npheap_release()
+
+
+// npheap_put() drops a reference to a node taken by mytree or a mapping.
+//
+// node: the node
+//
+// returns: void
+static void npheap_put(struct mytype *node)
+{
+  kref_put(&node->ref, npheap_release);
+}  //npheap_put()
+
+
+// npheap_free_work() frees the nodes queued on free_list in one batch.
+//
+// work: unused
+//
+// returns: void
+static void npheap_free_work(struct work_struct *work)
+{
+  struct mytype *node, *next;
+  LIST_HEAD(batch);
+
+  spin_lock(&free_lock);
+  list_splice_init(&free_list, &batch);
+  spin_unlock(&free_lock);
+
+  list_for_each_entry_safe(node, next, &batch, free_entry) {
+    npheap_free_node(node);
+    cond_resched();
+  }
+}  //npheap_free_work()
+
+
+// Objects between progress reports while tearing the heap down.
+#define NPHEAP_TEARDOWN_REPORT 1000000
+
+// npheap_teardown() frees every object in one postorder walk of mytree,
+// which never rebalances the tree. Only for unload, when nothing can be
+// mapped or queued on the expiry wheel's worker any more.
+//
+// returns: void
+static void npheap_teardown(void)
+{
+  struct mytype *node, *next;
+  unsigned long count = 0;
+  u64 bytes = 0;
+  ktime_t start = ktime_get();
+
+  rbtree_postorder_for_each_entry_safe(node, next, &mytree, node) {
+    bytes += node->node_cmd.size;
+    npheap_free_node(node);
+    if (++count % NPHEAP_TEARDOWN_REPORT == 0)
+      printk(KERN_INFO "npheap: freed %lu objects so far\n", count);
+    cond_resched();
+  }
+  mytree = RB_ROOT;
+  idtree = RB_ROOT;
+  tagtree = RB_ROOT;
+
+  printk(KERN_INFO "npheap: freed %lu objects (%llu bytes) in %lld ms\n",
+         count, bytes, ktime_ms_delta(ktime_get(), start));
+}  //npheap_teardown()
+
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Metadata directory.
+//
+////////////////////////////////////////////////////////////////////////
+
+// npheap_dir_init() allocates the metadata directory. The heap works
+// without one, users then fall back to NPHEAP_IOCTL_GETSIZE.
+//
+// returns: void
+static void npheap_dir_init(void)
+{
+  unsigned long nr = roundup_pow_of_two(max(dir_slots, 2U));
+
+  BUILD_BUG_ON((NPHEAP_DIR_OFFSET >> PAGE_SHIFT) <= NPHEAP_TOKEN_LAST);
+  dir_pages = 1 + DIV_ROUND_UP(nr * sizeof(struct npheap_dir_entry), PAGE_SIZE);
+  dir = vmalloc_user(dir_pages << PAGE_SHIFT);
+  if (!dir) {
+    printk(KERN_ERR "npheap: no memory for a %lu entry directory\n", nr);
+    return;
+  }
+  dir->magic = NPHEAP_DIR_MAGIC;
+  dir->entries_offset = PAGE_SIZE;
+  dir->nr_slots = nr;
+  dir->shift = ilog2(nr);
+  dir_entries = (void *)dir + PAGE_SIZE;
+}  //npheap_dir_init()
+
+
+// npheap_dir_write() rewrites a directory entry so that lockless readers
+// retry rather than see it half written. Caller holds tree_lock.
+//
+// entry: the entry to rewrite
+// flags: its new NPHEAP_DIR_* flags
+// offset: its new offset in bytes
+// size: its new size in bytes
+//
+// returns: void
+static void npheap_dir_write(struct npheap_dir_entry *entry, u32 flags,
+                             u64 offset, u64 size)
+{
+  WRITE_ONCE(entry->seq, entry->seq + 1);
+  smp_wmb();
+  WRITE_ONCE(entry->flags, flags);
+  WRITE_ONCE(entry->offset, offset);
+  WRITE_ONCE(entry->size, size);
+  WRITE_ONCE(entry->version, entry->version + 1);
+  smp_wmb();
+  WRITE_ONCE(entry->seq, entry->seq + 1);
+}  //npheap_dir_write()
+
+
+// npheap_dir_add() publishes a node just put in mytree. Caller holds
+// tree_lock.
+//
+// node: the node to publish
+//
+// returns: void
+static void npheap_dir_add(struct mytype *node)
+{
+  u64 offset = (u64)node->keystring << PAGE_SHIFT;
+  unsigned long i, slot;
+
+  node->dir_slot = -1;
+  if (!dir)
+    return;
+
+  // Probes and npheap_dir_remove() stop at an empty entry, so the last
+  // one is never handed out.
+  slot = npheap_dir_slot(offset, dir->shift);
+  for (i = 0; dir_used < dir->nr_slots - 1 && i < dir->nr_slots;
+       i++, slot = (slot + 1) & (dir->nr_slots - 1))
+    if (!(dir_entries[slot].flags & NPHEAP_DIR_USED)) {
+      npheap_dir_write(&dir_entries[slot], NPHEAP_DIR_USED |
+                       (node->has_id ? NPHEAP_DIR_HAS_ID : 0),
+                       offset, node->node_cmd.size);
+      node->dir_slot = slot;
+      dir_used++;
+      return;
+    }
+
+  // Full: readers have to ask the kernel about anything they don't find.
+  WRITE_ONCE(dir->missing, dir->missing + 1);
+}  //npheap_dir_add()
+
+
+// npheap_dir_remove() withdraws a node leaving mytree, already erased
+// from it. Entries probed past the freed one are shifted back into the
+// hole where their lookups still find them, so the table never fills up
+// with markers of deleted objects. Readers retry on dir->moves rather than
+// miss an entry while it moves. Caller holds tree_lock.
+//
+// node: the node to withdraw
+//
+// returns: void
+static void npheap_dir_remove(struct mytype *node)
+{
+  unsigned long mask, hole, next, home;
+  struct npheap_dir_entry *entry;
+  struct mytype *moved;
+  bool moving = false;
+
+  if (!dir)
+    return;
+  if (node->dir_slot < 0) {
+    WRITE_ONCE(dir->missing, dir->missing - 1);
+    return;
+  }
+
+  dir_used--;
+  mask = dir->nr_slots - 1;
+  hole = node->dir_slot;
+  for (next = (hole + 1) & mask; dir_entries[next].flags;
+       next = (next + 1) & mask) {
+    entry = &dir_entries[next];
+    home = npheap_dir_slot(entry->offset, dir->shift);
+
+    // An entry whose home lies between the hole and it has to stay put.
+    if (((next - home) & mask) < ((next - hole) & mask))
+      continue;
+    if (!moving) {
+      WRITE_ONCE(dir->moves, dir->moves + 1);
+      smp_wmb();
+      moving = true;
+    }
+    npheap_dir_write(&dir_entries[hole], entry->flags, entry->offset,
+                     entry->size);
+    moved = my_search(&mytree, entry->offset >> PAGE_SHIFT);
+    if (moved)
+      moved->dir_slot = hole;
+    hole = next;
+  }
+  npheap_dir_write(&dir_entries[hole], 0, 0, 0);
+  if (moving) {
+    smp_wmb();
+    WRITE_ONCE(dir->moves, dir->moves + 1);
+  }
+}  //npheap_dir_remove()
+
+
+// npheap_dir_fault() maps a page of the metadata directory. Faulting it
+// in again works after a snapshot zaps every mapping of the device.
+//
+// vmf: the fault
+//
+// returns: 0 with vmf->page set, VM_FAULT_SIGBUS past the directory
+static vm_fault_t npheap_dir_fault(struct vm_fault *vmf)
+{
+  unsigned long idx = vmf->pgoff - (NPHEAP_DIR_OFFSET >> PAGE_SHIFT);
+
+  if (idx >= dir_pages)
+    return VM_FAULT_SIGBUS;
+  vmf->page = vmalloc_to_page((void *)dir + (idx << PAGE_SHIFT));
+  get_page(vmf->page);
+  return 0;
+}  //npheap_dir_fault()
+
+
+static const struct vm_operations_struct npheap_dir_vm_ops = {
+  .fault = npheap_dir_fault,
+};
+
+
+// npheap_dir_mmap() maps the metadata directory, read-only.
+//
+// vma: the mapping at NPHEAP_DIR_OFFSET
+//
+// returns: 0 if successful, -ENODEV without a directory, -EPERM for a
+//          writable mapping
+static int npheap_dir_mmap(struct vm_area_struct *vma)
+{
+  if (!dir)
+    return -ENODEV;
+  if (vma->vm_flags & VM_WRITE)
+    return -EPERM;
+  vma->vm_flags &= ~VM_MAYWRITE;
+  vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+  vma->vm_ops = &npheap_dir_vm_ops;
+  return 0;
+}  //npheap_dir_mmap()
+
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Statistics.
+//
+////////////////////////////////////////////////////////////////////////
+
+// npheap_account() adds a node to or takes it off the live object totals.
+// Caller holds tree_lock.
+//
+// node: the node entering or leaving mytree
+// sign: 1 when it enters, -1 when it leaves
+//
+// returns: void
+static void npheap_account(struct mytype *node, int sign)
+{
+  unsigned int class = min_t(unsigned int, ilog2(node->nr_pages ?: 1),
+                             NPHEAP_SIZE_CLASSES - 1);
+
+  nr_objects += sign;
+  nr_bytes += sign * (s64)node->node_cmd.size;
+  class_objects[class] += sign;
+  class_bytes[class] += sign * (s64)node->node_cmd.size;
+}  //npheap_account()
+
+
+// npheap_may_create() checks a new object against the size limits. Caller
+// holds tree_lock.
+//
+// size: the size of the object in bytes
+//
+// returns: 0 if it may be created, -EFBIG if it is larger than
+//          max_object_size or NPHEAP_SIZE_MAX, -ENOSPC if it would grow
+//          the heap past max_heap_bytes
+static int npheap_may_create(u64 size)
+{
+  unsigned long max_size = READ_ONCE(max_object_size);
+  unsigned long max_bytes = READ_ONCE(max_heap_bytes);
+  u64 total;
+
+  if (size > NPHEAP_SIZE_MAX || (max_size && size > max_size))
+    return -EFBIG;
+  if (check_add_overflow(nr_bytes, size, &total) ||
+      (max_bytes && total > max_bytes))
+    return -ENOSPC;
+  return 0;
+}  //npheap_may_create()
+
+
+// npheap_linked() accounts for and publishes a node just put in mytree.
+// Caller holds tree_lock.
+//
+// node: the node put in mytree
+//
+// returns: void
+static void npheap_linked(struct mytype *node)
+{
+  node->generation = ++generation;
+  npheap_account(node, 1);
+  npheap_dir_add(node);
+  npheap_count(NPHEAP_STAT_CREATE);
+  npheap_count_add(NPHEAP_STAT_BYTES_CREATED, node->node_cmd.size);
+}  //npheap_linked()
+
+
+// npheap_created() records the latency of creating an object.
+//
+// node: the node created
+// start: ktime_get_ns() when its creation began
+//
+// returns: void
+static void npheap_created(struct mytype *node, u64 start)
+{
+  u64 ns = ktime_get_ns() - start;
+
+  npheap_hist_add(NPHEAP_HIST_CREATE, ns);
+  trace_npheap_create((u64)node->keystring << PAGE_SHIFT,
+                      node->node_cmd.size, ns);
+}  //npheap_created()
+
+
+// npheap_deleted() records the latency of deleting an object.
+//
+// offset: the offset of the object in bytes
+// size: its size in bytes
+// start: ktime_get_ns() when its deletion began
+//
+// returns: void
+static void npheap_deleted(u64 offset, u64 size, u64 start)
+{
+  u64 ns = ktime_get_ns() - start;
+
+  npheap_hist_add(NPHEAP_HIST_DELETE, ns);
+  trace_npheap_delete(offset, size, ns);
+}  //npheap_deleted()
+
+
+// npheap_holder_comm() finds the name of a process holding the heap lock.
+//
+// pid: its tgid in the initial pid namespace
+// comm: room for the name
+//
+// returns: void
+static void npheap_holder_comm(pid_t pid, char *comm)
+{
+  struct task_struct *task;
+
+  rcu_read_lock();
+  task = pid_task(find_pid_ns(pid, &init_pid_ns), PIDTYPE_PID);
+  if (task)
+    strscpy(comm, task->comm, TASK_COMM_LEN);
+  else
+    strscpy(comm, "?", TASK_COMM_LEN);
+  rcu_read_unlock();
+}  //npheap_holder_comm()
+
+
+// npheap_report_hold() reports a heap lock held longer than hold_warn_ms.
+//
+// pid: tgid of the holder
+// offset: the offset its command named, 0 if not known
+// hold: how long it has held the lock in ns
+//
+// returns: void
+static void npheap_report_hold(pid_t pid, u64 offset, u64 hold)
+{
+  char comm[TASK_COMM_LEN];
+
+  npheap_holder_comm(pid, comm);
+  trace_npheap_lock_held_long(pid, comm, offset, hold);
+  printk_ratelimited(KERN_WARNING
+                     "npheap: %s (%d) held the heap lock for %llu ms\n",
+                     comm, pid, hold / NSEC_PER_MSEC);
+}  //npheap_report_hold()
+
+
+// npheap_hold_work() reports, once a second, a heap lock held too long
+// while it is still held, so a holder that hangs doesn't go unnoticed.
+//
+// work: unused
+//
+// returns: void
+static void npheap_hold_work(struct work_struct *work)
+{
+  u64 limit = (u64)READ_ONCE(hold_warn_ms) * NSEC_PER_MSEC;
+  u64 hold = 0, offset = 0;
+  pid_t pid = 0;
+
+  spin_lock(&holder_lock);
+  if (limit && lock_holder && !lock_reported) {
+    hold = ktime_get_ns() - lock_acquired;
+    if (hold > limit) {
+      pid = lock_holder;
+      offset = lock_named ? lock_offset : 0;
+      lock_reported = true;
+    }
+  }
+  spin_unlock(&holder_lock);
+
+  if (pid)
+    npheap_report_hold(pid, offset, hold);
+  schedule_delayed_work(&hold_work, round_jiffies_relative(HZ));
+}  //npheap_hold_work()
+
+
+// npheap_lock_released() attributes a sampled heap lock just given up to
+// the object its command named, checksums that object if it asked for it
+// and reports the lock if it was held too long and npheap_hold_work()
+// hasn't yet. Caller still holds np_lock.
+//
+// pid: tgid of the holder
+// hold: how long the lock was held in ns
+// reported: whether npheap_hold_work() reported it already
+//
+// returns: void
+static void npheap_lock_released(pid_t pid, u64 hold, bool reported)
+{
+  struct mytype *node = NULL;
+
+  // Only sampled locks and, while there are any, checksummed objects need
+  // the object looked up.
+  if (lock_named && (lock_sampled || READ_ONCE(nr_checksummed))) {
+    mutex_lock(&tree_lock);
+    node = my_search(&mytree, lock_offset / PAGE_SIZE);
+    if (node && lock_sampled) {
+      atomic_inc(&node->locks);
+      if (lock_contended)
+        atomic_inc(&node->contended);
+      node->wait_ns += lock_wait;
+      node->hold_ns += hold;
+      WRITE_ONCE(node->last_access, jiffies);
+    }
+    if (node && node->checksummed)
+      kref_get(&node->ref);
+    else
+      node = NULL;
+    mutex_unlock(&tree_lock);
+  }
+
+  // Checksum outside tree_lock, it reads the whole object.
+  if (node) {
+    mutex_lock(&node->lock);
+    node->crc = npheap_checksum(node);
+    node->crc_valid = true;
+    mutex_unlock(&node->lock);
+    npheap_put(node);
+  }
+
+  if (!reported && hold_warn_ms && hold > (u64)hold_warn_ms * NSEC_PER_MSEC)
+    npheap_report_hold(pid, lock_named ? lock_offset : 0, hold);
+}  //npheap_lock_released()
+
+
+// npheap_heat_fault() attributes a sampled page fault to its object.
+//
+// node: the node faulted on
+//
+// returns: void
+static inline void npheap_heat_fault(struct mytype *node)
+{
+  if (npheap_sampled()) {
+    atomic_inc(&node->faults);
+    WRITE_ONCE(node->last_access, jiffies);
+  }
+}  //npheap_heat_fault()
+
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Object expiry.
+//
+////////////////////////////////////////////////////////////////////////
+
+// npheap_set_expiry() (re)files a node on the wheel. Caller holds tree_lock.
+//
+// node: the node whose time to live changes
+// ttl: seconds from now until it expires, 0 to never expire
+//
+// returns: void
+static void npheap_set_expiry(struct mytype *node, u64 ttl)
+{
+  if (node->expires) {
+    list_del_init(&node->ttl_entry);
+    ttl_count--;
+  }
+  node->expires = 0;
+  if (!ttl)
+    return;
+
+  // Round up so a node is only reaped once its whole last second is over.
+  node->expires = DIV_ROUND_UP(jiffies, HZ) + min_t(u64, ttl, NPHEAP_TTL_MAX);
+  list_add_tail(&node->ttl_entry,
+                &ttl_wheel[node->expires % NPHEAP_TTL_SLOTS]);
+  if (!ttl_count++) {
+    ttl_clock = jiffies / HZ;
+    schedule_delayed_work(&ttl_work, HZ);
+  }
+}  //npheap_set_expiry()
+
+
+// npheap_unlink() takes a node out of mytree, idtree, tagtree and the
+// expiry wheel.
+// Caller holds tree_lock.
+//
+// node: the node being deleted
+//
+// returns: void
+static void npheap_unlink(struct mytype *node)
+{
+  rb_erase(&node->node, &mytree);
+  if (node->has_id)
+    rb_erase(&node->id_node, &idtree);
+  if (node->tag)
+    rb_erase(&node->tag_node, &tagtree);
+  if (node->checksummed)
+    nr_checksummed--;
+  npheap_dir_remove(node);
+  npheap_account(node, -1);
+  npheap_count_add(NPHEAP_STAT_BYTES_DELETED, node->node_cmd.size);
+  npheap_set_expiry(node, 0);
+}  //npheap_unlink()
+
+
+// npheap_ttl_work() sweeps the wheel slots for every second that passed
+// since the last sweep and reclaims their expired nodes in one batch.
+// Expiry waits while the heap is locked, so a holder never sees its
+// objects vanish underneath it, but only for NPHEAP_TTL_MAX_MISSES ticks
+// before it queues up for the lock like everyone else.
+//
+// work: unused
+//
+// returns: void
+static void npheap_ttl_work(struct work_struct *work)
+{
+  unsigned long now = jiffies / HZ;
+  unsigned long sweeps;
+  struct mytype *node, *next;
+  u64 start, offset, size;
+
+  if (ttl_misses < NPHEAP_TTL_MAX_MISSES) {
+    if (!mutex_trylock(&np_lock)) {
+      ttl_misses++;
+      goto rearm;
+    }
+  } else
+    mutex_lock(&np_lock);
+  ttl_misses = 0;
+  mutex_lock(&tree_lock);
+
+  sweeps = min(now - ttl_clock, (unsigned long)NPHEAP_TTL_SLOTS);
+  for (; sweeps; sweeps--) {
+    struct list_head *slot = &ttl_wheel[(now - sweeps + 1) % NPHEAP_TTL_SLOTS];
+
+    list_for_each_entry_safe(node, next, slot, ttl_entry) {
+      if (node->expires > now)
+        continue;
+      start = ktime_get_ns();
+      offset = (u64)node->keystring << PAGE_SHIFT;
+      size = node->node_cmd.size;
+      npheap_unlink(node);
+      npheap_put(node);
+      npheap_count(NPHEAP_STAT_EXPIRE);
+      npheap_deleted(offset, size, start);
+    }
+  }
+  ttl_clock = now;
+
+  mutex_unlock(&tree_lock);
+  mutex_unlock(&np_lock);
+
+rearm:
+  mutex_lock(&tree_lock);
+  if (ttl_count)
+    schedule_delayed_work(&ttl_work, HZ);
+  mutex_unlock(&tree_lock);
+}  //npheap_ttl_work()
+
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Heap snapshots.
+//
+////////////////////////////////////////////////////////////////////////
+
+// A frozen copy of every object, sharing pages copy-on-write with the live
+// heap. Read from its fd to stream the objects out, or mmap an object at
+// its offset to inspect it in place.
+struct npheap_snapshot {
+  struct rb_root objects;
+  struct mutex lock;  //guards the cursor and lazily zeroed pages
+  struct mytype *cursor;  //object read() is streaming
+  loff_t pos;  //bytes of the cursor's record already streamed
+};
+
+
+// npheap_snapshot_free() drops a snapshot and its page references.
+//
+// snap: the snapshot to free
+//
+// returns: void
+static void npheap_snapshot_free(struct npheap_snapshot *snap)
+{
+  struct mytype *node, *next;
+
+  rbtree_postorder_for_each_entry_safe(node, next, &snap->objects, node)
+    npheap_free_node(node);
+  kfree(snap);
+}  //npheap_snapshot_free()
+
+
+// npheap_snapshot_read() streams the snapshot as npheap_record headers,
+// each followed by the object's data, in offset order.
+//
+// filp: the snapshot file
+// buf: user buffer to fill
+// count: size of buf
+// ppos: file position, advanced by what was read
+//
+// returns: bytes read, 0 at the end of the snapshot, -EFAULT
+static ssize_t npheap_snapshot_read(struct file *filp, char __user *buf,
+                                    size_t count, loff_t *ppos)
+{
+  struct npheap_snapshot *snap = filp->private_data;
+  ssize_t done = 0;
+
+  mutex_lock(&snap->lock);
+  while (count && snap->cursor) {
+    struct mytype *node = snap->cursor;
+    struct npheap_record rec;
+    size_t chunk;
+    loff_t off;
+
+    // The record header comes first.
+    if (snap->pos < sizeof(struct npheap_record)) {
+      rec.offset = (__u64)node->keystring << PAGE_SHIFT;
+      rec.size = node->node_cmd.size;
+      chunk = min_t(size_t, count, sizeof(struct npheap_record) - snap->pos);
+      if (copy_to_user(buf, (char *)&rec + snap->pos, chunk))
+        break;
+    }
+    // Then the data, zeros for pages never touched.
+    else {
+      off = snap->pos - sizeof(struct npheap_record);
+      if (off >= node->node_cmd.size) {
+        snap->cursor = rb_entry_safe(rb_next(&node->node), struct mytype, node);
+        snap->pos = 0;
+        continue;
+      }
+      chunk = min_t(size_t, count, PAGE_SIZE - offset_in_page(off));
+      chunk = min_t(size_t, chunk, node->node_cmd.size - off);
+      if (node->pages[off >> PAGE_SHIFT]) {
+        char *addr = kmap(node->pages[off >> PAGE_SHIFT]);
+        unsigned long left;
+
+        left = copy_to_user(buf, addr + offset_in_page(off), chunk);
+        kunmap(node->pages[off >> PAGE_SHIFT]);
+        if (left)
+          break;
+      }
+      else if (clear_user(buf, chunk))
+        break;
+    }
+    snap->pos += chunk;
+    buf += chunk;
+    count -= chunk;
+    done += chunk;
+  }
+  mutex_unlock(&snap->lock);
+
+  if (count && !done && snap->cursor)
+    return -EFAULT;
+  *ppos += done;
+  return done;
+}  //npheap_snapshot_read()
+
+
+// npheap_snapshot_fault() maps one page of a snapshot object read-only.
+//
+// vmf: the fault, vm_private_data of its vma holds the object's key
+//
+// returns: VM_FAULT_NOPAGE once mapped, VM_FAULT_SIGBUS outside an object,
+//          VM_FAULT_OOM if out of memory
+static vm_fault_t npheap_snapshot_fault(struct vm_fault *vmf)
+{
+  struct npheap_snapshot *snap = vmf->vma->vm_file->private_data;
+  vm_fault_t ret = VM_FAULT_SIGBUS;
+  struct mytype *node;
+  unsigned long idx;
+
+  mutex_lock(&snap->lock);
+  node = my_search(&snap->objects, (unsigned long)vmf->vma->vm_private_data);
+  idx = vmf->pgoff - (node ? node->keystring : 0);
+  if (node && idx < node->nr_pages) {
+    if (!node->pages[idx])
+      node->pages[idx] = alloc_page(GFP_HIGHUSER | __GFP_ZERO);
+    if (node->pages[idx])
+      ret = vmf_insert_pfn(vmf->vma, vmf->address,
+                           page_to_pfn(node->pages[idx]));
+    else
+      ret = VM_FAULT_OOM;
+  }
+  mutex_unlock(&snap->lock);
+  return ret;
+}  //npheap_snapshot_fault()
+
+
+static const struct vm_operations_struct npheap_snapshot_vm_ops = {
+  .fault = npheap_snapshot_fault,
+};
+
+
+// npheap_snapshot_mmap() maps a snapshot object read-only.
+//
+// filp: the snapshot file
+// vma: the area to map, vm_pgoff is the object's offset
+//
+// returns: 0 if successful, -EACCES for a writable mapping
+static int npheap_snapshot_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+  if (vma->vm_flags & VM_WRITE)
+    return -EACCES;
+
+  vma->vm_flags &= ~VM_MAYWRITE;
+  vma->vm_flags |= VM_PFNMAP | VM_DONTEXPAND | VM_DONTDUMP;
+  vma->vm_private_data = (void *)vma->vm_pgoff;
+  vma->vm_ops = &npheap_snapshot_vm_ops;
+  return 0;
+}  //npheap_snapshot_mmap()
+
+
+// npheap_snapshot_release() frees the snapshot once its last user is gone.
+//
+// inode: unused
+// filp: the snapshot file
+//
+// returns: 0
+static int npheap_snapshot_release(struct inode *inode, struct file *filp)
+{
+  npheap_snapshot_free(filp->private_data);
+  return 0;
+}  //npheap_snapshot_release()
+
+
+static const struct file_operations npheap_snapshot_fops = {
+  .owner = THIS_MODULE,
+  .read = npheap_snapshot_read,
+  .mmap = npheap_snapshot_mmap,
+  .release = npheap_snapshot_release,
+  .llseek = noop_llseek,
+};
+
+
+// npheap_snapshot() freezes a copy-on-write image of the whole heap. Writers
+// are held off only while page references are taken, not while the image
+// is read.
+//
+// returns: a read-only file descriptor for the snapshot or a negative errno
+long npheap_snapshot(void)
+{
+  struct npheap_snapshot *snap = kzalloc(sizeof(struct npheap_snapshot),
+                                         GFP_KERNEL);
+  struct address_space *mapping;
+  struct mytype *node, *copy;
+  struct rb_node *rb;
+  int fd;
+
+  if (!snap)
+    return -ENOMEM;
+  snap->objects = RB_ROOT;
+  mutex_init(&snap->lock);
+
+  // Write-protect the whole live heap first, so every write from here on
+  // faults and waits for the freeze to end, then splits a shared page.
+  down_write(&freeze_sem);
+  mapping = READ_ONCE(npheap_mapping);
+  if (mapping)
+    unmap_mapping_range(mapping, 0, 0, 1);
+
+  mutex_lock(&tree_lock);
+  for (rb = rb_first(&mytree); rb; rb = rb_next(rb)) {
+    node = rb_entry(rb, struct mytype, node);
+    copy = npheap_new_node(node->keystring, node->node_cmd.size);
+    if (!copy) {
+      mutex_unlock(&tree_lock);
+      up_write(&freeze_sem);
+      npheap_snapshot_free(snap);
+      return -ENOMEM;
+    }
+    mutex_lock(&node->lock);
+    npheap_share_pages(node, copy);
+    mutex_unlock(&node->lock);
+    my_insert(&snap->objects, copy);
+  }
+  mutex_unlock(&tree_lock);
+  up_write(&freeze_sem);
+
+  snap->cursor = rb_entry_safe(rb_first(&snap->objects), struct mytype, node);
+  fd = anon_inode_getfd("[npheap-snapshot]", &npheap_snapshot_fops, snap,
+                        O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    npheap_snapshot_free(snap);
+  return fd;
+}  //npheap_snapshot()
+
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Checkpoint restore.
+//
+////////////////////////////////////////////////////////////////////////
+
+// Pages of one object read by a single restore job.
+#define NPHEAP_RESTORE_CHUNK 256
+
+// State shared by all jobs of one restore.
+struct npheap_restore {
+  struct file *image;
+  atomic_t error;
+};
+
+// One run of an object's pages to be read from the image.
+struct npheap_restore_job {
+  struct work_struct work;
+  struct npheap_restore *restore;
+  struct mytype *node;
+  unsigned long first;  //index of the first page to read
+  unsigned long nr;
+  loff_t pos;  //image position of the first page's data
+};
+
+
+// npheap_restore_work() reads a run of pages from the image. Pages that
+// are all zeros are left unallocated, like pages never touched.
+//
+// work: the npheap_restore_job
+//
+// returns: void
+static void npheap_restore_work(struct work_struct *work)
+{
+  struct npheap_restore_job *job =
+    container_of(work, struct npheap_restore_job, work);
+  struct mytype *node = job->node;
+  loff_t pos = job->pos;
+  unsigned long i;
+
+  for (i = job->first; i < job->first + job->nr; i++) {
+    size_t len = min_t(u64, PAGE_SIZE,
+                       node->node_cmd.size - ((u64)i << PAGE_SHIFT));
+    struct page *page = alloc_page(GFP_HIGHUSER | __GFP_ZERO);
+    void *addr;
+    ssize_t n;
+
+    if (!page) {
+      atomic_set(&job->restore->error, -ENOMEM);
+      break;
+    }
+    addr = kmap(page);
+    n = kernel_read(job->restore->image, addr, len, &pos);
+    if (n == (ssize_t)len && memchr_inv(addr, 0, len))
+      node->pages[i] = page;
+    kunmap(page);
+    if (node->pages[i] != page)
+      put_page(page);
+    if (n != (ssize_t)len) {
+      atomic_set(&job->restore->error, n < 0 ? n : -EINVAL);
+      break;
+    }
+  }
+  kfree(job);
+}  //npheap_restore_work()
+
+
+// npheap_record_ok() checks an image record describes an object a heap can
+// hold. Keys in the token range are fine, objects created by id are
+// checkpointed there, but nothing lives at or above the directory.
+//
+// rec: the record read from the image
+//
+// returns: true if it may be restored
+static bool npheap_record_ok(const struct npheap_record *rec)
+{
+  return rec->size && rec->size <= NPHEAP_SIZE_MAX &&
+         !(rec->offset & ~PAGE_MASK) &&
+         rec->offset >> PAGE_SHIFT <= NPHEAP_TOKEN_LAST;
+}  //npheap_record_ok()
+
+
+// npheap_restore_file() loads every object of a checkpoint image, reading
+// object data with parallel workers. Objects appear in the heap only once
+// the whole image is read, and offsets already in use are left alone, as
+// are objects over the size limits.
+//
+// image: the image file, positioned anywhere
+//
+// returns: the number of objects restored or a negative errno
+static long npheap_restore_file(struct file *image)
+{
+  struct npheap_restore restore = { .image = image };
+  struct npheap_image_header hdr;
+  struct npheap_record rec;
+  struct workqueue_struct *wq;
+  struct mytype *node, *next;
+  LIST_HEAD(restored);
+  loff_t pos = 0;
+  long count = 0;
+  unsigned long i;
+
+  atomic_set(&restore.error, 0);
+  if (kernel_read(image, &hdr, sizeof(hdr), &pos) != sizeof(hdr) ||
+      hdr.magic != NPHEAP_IMAGE_MAGIC || hdr.version != NPHEAP_IMAGE_VERSION)
+    return -EINVAL;
+
+  wq = alloc_workqueue("npheap_restore", WQ_UNBOUND,
+                       restore_workers ?: num_online_cpus());
+  if (!wq)
+    return -ENOMEM;
+
+  // Walk the record headers here and hand the data to the workers.
+  while (!atomic_read(&restore.error)) {
+    ssize_t n = kernel_read(image, &rec, sizeof(rec), &pos);
+
+    if (n == 0)
+      break;
+    // The image is untrusted: stop at the first record that could not
+    // have come from a heap.
+    if (n != sizeof(rec) || !npheap_record_ok(&rec)) {
+      atomic_set(&restore.error, n < 0 ? n : -EINVAL);
+      break;
+    }
+    node = npheap_new_node(rec.offset >> PAGE_SHIFT, rec.size);
+    if (!node) {
+      atomic_set(&restore.error, -ENOMEM);
+      break;
+    }
+    list_add_tail(&node->free_entry, &restored);
+
+    for (i = 0; i < node->nr_pages; i += NPHEAP_RESTORE_CHUNK) {
+      struct npheap_restore_job *job = kmalloc(sizeof(*job), GFP_KERNEL);
+
+      if (!job) {
+        atomic_set(&restore.error, -ENOMEM);
+        break;
+      }
+      INIT_WORK(&job->work, npheap_restore_work);
+      job->restore = &restore;
+      job->node = node;
+      job->first = i;
+      job->nr = min_t(unsigned long, NPHEAP_RESTORE_CHUNK, node->nr_pages - i);
+      job->pos = pos + ((loff_t)i << PAGE_SHIFT);
+      queue_work(wq, &job->work);
+    }
+    if (check_add_overflow(pos, (loff_t)rec.size, &pos)) {
+      atomic_set(&restore.error, -EINVAL);
+      break;
+    }
+  }
+  destroy_workqueue(wq);
+
+  list_for_each_entry_safe(node, next, &restored, free_entry) {
+    list_del(&node->free_entry);
+    mutex_lock(&tree_lock);
+    if (!atomic_read(&restore.error) &&
+        !npheap_may_create(node->node_cmd.size) && my_insert(&mytree, node)) {
+      npheap_linked(node);
+      npheap_set_expiry(node, default_ttl);
+      node = NULL;
+      count++;
+    }
+    mutex_unlock(&tree_lock);
+    if (node)
+      npheap_free_node(node);
+  }
+  return atomic_read(&restore.error) ?: count;
+}  //npheap_restore_file()
+
+
+// npheap_restore_fd() restores a checkpoint image from an open file.
+//
+// fd: file descriptor of the image
+//
+// returns: the number of objects restored or a negative errno
+long npheap_restore_fd(unsigned int fd)
+{
+  struct file *image = fget(fd);
+  long ret;
+
+  if (!image)
+    return -EBADF;
+  ret = npheap_restore_file(image);
+  fput(image);
+  return ret;
+}  //npheap_restore_fd()
+
+
+// npheap_restore_path() restores the image named by the restore parameter.
+//
+// path: the image's path
+//
+// returns: void, failures are logged and leave the heap empty
+static void npheap_restore_path(const char *path)
+{
+  struct file *image = filp_open(path, O_RDONLY | O_LARGEFILE, 0);
+  long ret;
+
+  if (IS_ERR(image)) {
+    printk(KERN_ERR "npheap: cannot open %s: %ld\n", path, PTR_ERR(image));
+    return;
+  }
+  ret = npheap_restore_file(image);
+  filp_close(image, NULL);
+  if (ret < 0)
+    printk(KERN_ERR "npheap: restoring %s failed: %ld\n", path, ret);
+  else
+    printk(KERN_INFO "npheap: restored %ld objects from %s\n", ret, path);
+}  //npheap_restore_path()
+
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Live upgrade handoff.
+//
+////////////////////////////////////////////////////////////////////////
+
+// npheap_park() hands every object to npheap_handoff.ko on unload so the
+// next npheap.ko to load can adopt them. Nothing can be mapped any more.
+//
+// returns: true if the objects were parked and mytree is now empty
+static bool npheap_park(void)
+{
+  void (*park)(struct npheap_handoff *) = symbol_get(npheap_handoff_park);
+  struct npheap_handoff *handoff;
+  struct mytype *node, *next;
+  unsigned long count = 0;
+  struct rb_node *rb;
+
+  if (!park)
+    return false;
+
+  for (rb = rb_first(&mytree); rb; rb = rb_next(rb))
+    count++;
+  handoff = kvmalloc(struct_size(handoff, objects, count), GFP_KERNEL);
+  if (!handoff) {
+    // The caller frees them, which loses what the upgrade was meant to keep.
+    printk(KERN_ERR "npheap: no memory to park %lu objects, discarding them\n",
+           count);
+    symbol_put(npheap_handoff_park);
+    return false;
+  }
+
+  handoff->version = NPHEAP_HANDOFF_VERSION;
+  handoff->nr_objects = 0;
+  rbtree_postorder_for_each_entry_safe(node, next, &mytree, node) {
+    struct npheap_parked_object *obj = &handoff->objects[handoff->nr_objects++];
+
+    obj->keystring = node->keystring;
+    obj->size = node->node_cmd.size;
+    obj->nr_pages = node->nr_pages;
+    obj->pages = node->pages;
+    obj->cow = node->cow;
+    obj->dirty = node->dirty;
+    obj->expires = node->expires;
+    obj->has_id = node->has_id;
+    obj->id = node->id;
+    obj->checksummed = node->checksummed;
+    obj->crc_valid = node->crc_valid;
+    obj->crc = node->crc;
+    obj->tag = node->tag;
+    obj->prefault = node->prefault;
+    kfree(node);
+  }
+  mytree = RB_ROOT;
+  idtree = RB_ROOT;
+  tagtree = RB_ROOT;
+
+  park(handoff);
+  symbol_put(npheap_handoff_park);
+  return true;
+}  //npheap_park()
+
+
+// npheap_repark() gives a handoff we cannot adopt back to npheap_handoff.ko.
+//
+// handoff: the handoff to give back
+//
+// returns: void
+static void npheap_repark(struct npheap_handoff *handoff)
+{
+  void (*park)(struct npheap_handoff *) = symbol_get(npheap_handoff_park);
+
+  if (park) {
+    park(handoff);
+    symbol_put(npheap_handoff_park);
+  }
+}  //npheap_repark()
+
+
+// npheap_adopt() takes over the objects a previous npheap.ko parked.
+//
+// returns: void
+static void npheap_adopt(void)
+{
+  struct npheap_handoff *(*take)(void) = symbol_get(npheap_handoff_take);
+  struct npheap_handoff *handoff;
+  unsigned long now = jiffies / HZ;
+  unsigned long i;
+
+  if (!take)
+    return;
+  handoff = take();
+  symbol_put(npheap_handoff_take);
+  if (!handoff)
+    return;
+
+  // Layout changed under us: put it back for a matching module to find.
+  if (handoff->version != NPHEAP_HANDOFF_VERSION) {
+    printk(KERN_ERR "npheap: cannot adopt handoff of version %u\n",
+           handoff->version);
+    npheap_repark(handoff);
+    return;
+  }
+
+  mutex_lock(&tree_lock);
+  for (i = 0; i < handoff->nr_objects; i++) {
+    struct npheap_parked_object *obj = &handoff->objects[i];
+    struct mytype *node = kzalloc(sizeof(struct mytype), GFP_KERNEL);
+
+    if (!node) {
+      // Keep what's left parked rather than leak it.
+      memmove(handoff->objects, obj, (handoff->nr_objects - i) * sizeof(*obj));
+      handoff->nr_objects -= i;
+      mutex_unlock(&tree_lock);
+      npheap_repark(handoff);
+      return;
+    }
+    node->keystring = obj->keystring;
+    node->node_cmd.offset = obj->keystring;
+    node->node_cmd.size = obj->size;
+    node->nr_pages = obj->nr_pages;
+    node->pages = obj->pages;
+    node->cow = obj->cow;
+    node->dirty = obj->dirty;
+    kref_init(&node->ref);
+    mutex_init(&node->lock);
+    INIT_LIST_HEAD(&node->ttl_entry);
+    my_insert(&mytree, node);
+    node->has_id = obj->has_id;
+    node->id = obj->id;
+    node->checksummed = obj->checksummed;
+    if (node->checksummed)
+      nr_checksummed++;
+    node->crc_valid = obj->crc_valid;
+    node->crc = obj->crc;
+    node->tag = obj->tag;
+    node->prefault = obj->prefault;
+    if (node->tag)
+      npheap_tag_insert(&tagtree, node);
+    if (node->has_id)
+      npheap_id_insert(&idtree, node);
+    npheap_linked(node);
+    if (obj->expires)
+      npheap_set_expiry(node, obj->expires > now ? obj->expires - now : 1);
+  }
+  mutex_unlock(&tree_lock);
+
+  printk(KERN_INFO "npheap: adopted %lu objects\n", handoff->nr_objects);
+  kvfree(handoff);
+}  //npheap_adopt()
+
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Self-test.
+//
+////////////////////////////////////////////////////////////////////////
+
+// npheap_selftest() times allocating, inserting, looking up, erasing and
+// freeing nr one page objects in a private tree, through the functions
+// the heap itself uses, and prints the ns per operation of each phase.
+//
+// nr: the number of objects
+//
+// returns: void
+static void npheap_selftest(unsigned int nr)
+{
+  static const char * const phases[] = {
+    "alloc", "insert", "lookup", "erase", "free"
+  };
+  struct rb_root root = RB_ROOT;
+  struct mytype **nodes;
+  u64 ns[ARRAY_SIZE(phases)];
+  unsigned int i, missed = 0;
+  int phase;
+
+  nodes = kvmalloc_array(nr, sizeof(*nodes), GFP_KERNEL);
+  if (!nodes) {
+    printk(KERN_ERR "npheap: no memory for a %u object selftest\n", nr);
+    return;
+  }
+
+  for (phase = 0; phase < ARRAY_SIZE(phases); phase++) {
+    u64 start = ktime_get_ns();
+
+    for (i = 0; i < nr; i++) {
+      switch (phase) {
+      case 0:
+        // Multiplying by an odd constant scatters the keys without
+        // repeating any of them.
+        nodes[i] = npheap_new_node((u32)(i * 0x9e3779b9U), PAGE_SIZE);
+        if (!nodes[i]) {
+          printk(KERN_ERR "npheap: selftest ran out of memory\n");
+          nr = i;
+        }
+        break;
+      case 1:
+        my_insert(&root, nodes[i]);
+        break;
+      case 2:
+        if (my_search(&root, nodes[i]->keystring) != nodes[i])
+          missed++;
+        break;
+      case 3:
+        rb_erase(&nodes[i]->node, &root);
+        break;
+      case 4:
+        npheap_free_node(nodes[i]);
+        break;
+      }
+      if (i % 1024 == 0)
+        cond_resched();
+    }
+    ns[phase] = ktime_get_ns() - start;
+  }
+  kvfree(nodes);
+
+  for (phase = 0; phase < ARRAY_SIZE(phases); phase++)
+    printk(KERN_INFO "npheap: selftest %s %llu ns/op\n", phases[phase],
+           nr ? ns[phase] / nr : 0);
+  printk(KERN_INFO "npheap: selftest %u objects, %u lookups missed\n", nr,
+         missed);
+}  //npheap_selftest()
+
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Debugfs statistics.
+//
+////////////////////////////////////////////////////////////////////////
+
+static const char * const stat_names[NPHEAP_NR_STATS] = {
+  [NPHEAP_STAT_LOCK] = "lock",
+  [NPHEAP_STAT_UNLOCK] = "unlock",
+  [NPHEAP_STAT_GETSIZE] = "getsize",
+  [NPHEAP_STAT_DELETE] = "delete",
+  [NPHEAP_STAT_MMAP] = "mmap",
+  [NPHEAP_STAT_CREATE] = "create",  //objects added, by any means
+  [NPHEAP_STAT_EXPIRE] = "expire",
+  [NPHEAP_STAT_ALLOC_FAIL] = "alloc_fail",
+  [NPHEAP_STAT_FAULT] = "fault",
+  [NPHEAP_STAT_BYTES_CREATED] = "bytes_created",
+  [NPHEAP_STAT_BYTES_DELETED] = "bytes_deleted",
+  [NPHEAP_STAT_PREFAULT] = "prefault",  //pages mapped ahead of a fault
+};
+
+
+// npheap_ops_show() prints one "name count" line per counter, summed over
+// all cpus.
+static int npheap_ops_show(struct seq_file *m, void *v)
+{
+  u64 count;
+  int cpu, i;
+
+  for (i = 0; i < NPHEAP_NR_STATS; i++) {
+    count = 0;
+    for_each_possible_cpu(cpu)
+      count += per_cpu(op_stats, cpu).count[i];
+    seq_printf(m, "%s %llu\n", stat_names[i], count);
+  }
+  return 0;
+}  //npheap_ops_show()
+DEFINE_SHOW_ATTRIBUTE(npheap_ops);
+
+
+// npheap_size_classes_show() prints "pages objects bytes" for each size
+// class in use, pages being the smallest object size in the class.
+static int npheap_size_classes_show(struct seq_file *m, void *v)
+{
+  int i;
+
+  mutex_lock(&tree_lock);
+  for (i = 0; i < NPHEAP_SIZE_CLASSES; i++)
+    if (class_objects[i])
+      seq_printf(m, "%lu %lu %llu\n", 1UL << i, class_objects[i],
+                 class_bytes[i]);
+  mutex_unlock(&tree_lock);
+  return 0;
+}  //npheap_size_classes_show()
+DEFINE_SHOW_ATTRIBUTE(npheap_size_classes);
+
+
+// npheap_lock_holder_show() prints "pid comm offset held_ms" for the
+// process holding the heap lock, or "none".
+static int npheap_lock_holder_show(struct seq_file *m, void *v)
+{
+  char comm[TASK_COMM_LEN];
+  __u64 offset;
+  u64 acquired;
+  pid_t pid;
+
+  spin_lock(&holder_lock);
+  pid = lock_holder;
+  offset = lock_named ? lock_offset : 0;
+  acquired = lock_acquired;
+  spin_unlock(&holder_lock);
+
+  if (!pid) {
+    seq_puts(m, "none\n");
+    return 0;
+  }
+  npheap_holder_comm(pid, comm);
+  seq_printf(m, "%d %s %llu %llu\n", pid, comm, offset,
+             (ktime_get_ns() - acquired) / NSEC_PER_MSEC);
+  return 0;
+}  //npheap_lock_holder_show()
+DEFINE_SHOW_ATTRIBUTE(npheap_lock_holder);
+
+
+// npheap_hot_keys_show() prints the hottest objects, hottest first, as
+// "offset locks contended wait_us hold_us faults ms_since_last_access".
+// Locks and faults are samples, 1 in heat_sample of the real count.
+static int npheap_hot_keys_show(struct seq_file *m, void *v)
+{
+  struct mytype *hot[NPHEAP_HOT_KEYS];
+  unsigned long heat[NPHEAP_HOT_KEYS];
+  struct rb_node *rb;
+  int nr = 0, i;
+
+  seq_printf(m, "# 1 in %u locks and faults sampled\n",
+             READ_ONCE(heat_sample));
+  mutex_lock(&tree_lock);
+  for (rb = rb_first(&mytree); rb; rb = rb_next(rb)) {
+    struct mytype *node = rb_entry(rb, struct mytype, node);
+    unsigned long h = atomic_read(&node->locks) +
+                      atomic_read(&node->contended) +
+                      atomic_read(&node->faults);
+
+    // Keep hot[] sorted hottest first, insertion style.
+    if (!h || (nr == NPHEAP_HOT_KEYS && h <= heat[nr - 1]))
+      continue;
+    if (nr < NPHEAP_HOT_KEYS)
+      nr++;
+    for (i = nr - 1; i > 0 && heat[i - 1] < h; i--) {
+      hot[i] = hot[i - 1];
+      heat[i] = heat[i - 1];
+    }
+    hot[i] = node;
+    heat[i] = h;
+  }
+  for (i = 0; i < nr; i++)
+    seq_printf(m, "%llu %d %d %llu %llu %d %u\n",
+               (u64)hot[i]->keystring << PAGE_SHIFT,
+               atomic_read(&hot[i]->locks), atomic_read(&hot[i]->contended),
+               hot[i]->wait_ns / NSEC_PER_USEC, hot[i]->hold_ns / NSEC_PER_USEC,
+               atomic_read(&hot[i]->faults),
+               jiffies_to_msecs(jiffies - READ_ONCE(hot[i]->last_access)));
+  mutex_unlock(&tree_lock);
+  return 0;
+}  //npheap_hot_keys_show()
+DEFINE_SHOW_ATTRIBUTE(npheap_hot_keys);
+
+
+static const char * const hist_names[NPHEAP_NR_HISTS] = {
+  [NPHEAP_HIST_LOCK_WAIT] = "lock_wait",
+  [NPHEAP_HIST_LOCK_HOLD] = "lock_hold",
+  [NPHEAP_HIST_MMAP] = "mmap",
+  [NPHEAP_HIST_CREATE] = "create",
+  [NPHEAP_HIST_DELETE] = "delete",
+  [NPHEAP_HIST_CHECKSUM] = "checksum",
+};
+
+
+// npheap_hist_show() prints "ns count" for every non-empty bucket of a
+// latency histogram, ns being the bucket's upper bound, then the p50, p99
+// and p999 upper bounds.
+static int npheap_hist_show(struct seq_file *m, void *v)
+{
+  static const unsigned int permille[] = { 500, 990, 999 };
+  static const char * const labels[] = { "p50", "p99", "p999" };
+  enum npheap_hist hist = (uintptr_t)m->private;
+  u64 buckets[NPHEAP_HIST_BUCKETS] = { 0 };
+  u64 total = 0, seen = 0;
+  int cpu, i, p = 0;
+
+  for_each_possible_cpu(cpu)
+    for (i = 0; i < NPHEAP_HIST_BUCKETS; i++)
+      buckets[i] += per_cpu(hists, cpu).buckets[hist][i];
+  for (i = 0; i < NPHEAP_HIST_BUCKETS; i++) {
+    total += buckets[i];
+    if (buckets[i])
+      seq_printf(m, "%llu %llu\n", 2ULL << i, buckets[i]);
+  }
+  if (!total)
+    return 0;
+
+  // Bucket bounds are powers of two, so are the percentiles.
+  for (i = 0; i < NPHEAP_HIST_BUCKETS && p < ARRAY_SIZE(permille); i++) {
+    seen += buckets[i];
+    while (p < ARRAY_SIZE(permille) && seen * 1000 >= total * permille[p])
+      seq_printf(m, "%s %llu\n", labels[p++], 2ULL << i);
   }
+  return 0;
+}  //npheap_hist_show()
+DEFINE_SHOW_ATTRIBUTE(npheap_hist);
 
-  // Add new node and rebalance tree.
-  rb_link_node(&data->node, parent, new);
-  rb_insert_color(&data->node, root);
 
-return 1;
-}  //my_insert()
+// npheap_hist_reset_write() empties every latency histogram on a write.
+static ssize_t npheap_hist_reset_write(struct file *filp,
+                                       const char __user *buf, size_t count,
+                                       loff_t *ppos)
+{
+  int cpu;
 
+  for_each_possible_cpu(cpu)
+    memset(per_cpu_ptr(&hists, cpu), 0, sizeof(struct npheap_hists));
+  return count;
+}  //npheap_hist_reset_write()
 
-// rb_erase() is part of linux/rbtree.h.
-//
-// victim: node to be removed (found using search)
-// rb_root: the rb tree rb_root
-//
-// return: void
-//  void rb_erase(struct rb_node *victim, struct rb_root *tree);
-//
-// Example:
-//
-//   struct mytype *data = mysearch(mytree, "walrus");
+
+static const struct file_operations npheap_hist_reset_fops = {
+  .owner = THIS_MODULE,
+  .write = npheap_hist_reset_write,
+};
+
+
+// npheap_debugfs_init() creates /sys/kernel/debug/npheap. Failures are
+// ignored, the heap works the same without it.
 //
-//   if (data) {
-//   	rb_erase(data->node, mytree);
-//   	myfree(data);
-//   }
+// returns: void
+static void npheap_debugfs_init(void)
+{
+  struct dentry *latency;
+  int i;
+
+  debugfs_dir = debugfs_create_dir("npheap", NULL);
+  debugfs_create_ulong("objects", 0444, debugfs_dir, &nr_objects);
+  debugfs_create_u64("bytes", 0444, debugfs_dir, &nr_bytes);
+  debugfs_create_file("size_classes", 0444, debugfs_dir, NULL,
+                      &npheap_size_classes_fops);
+  debugfs_create_file("ops", 0444, debugfs_dir, NULL, &npheap_ops_fops);
+  debugfs_create_file("lock_holder", 0444, debugfs_dir, NULL,
+                      &npheap_lock_holder_fops);
+  debugfs_create_file("hot_keys", 0444, debugfs_dir, NULL,
+                      &npheap_hot_keys_fops);
+
+  latency = debugfs_create_dir("latency", debugfs_dir);
+  for (i = 0; i < NPHEAP_NR_HISTS; i++)
+    debugfs_create_file(hist_names[i], 0444, latency, (void *)(uintptr_t)i,
+                        &npheap_hist_fops);
+  debugfs_create_file("reset", 0200, latency, NULL, &npheap_hist_reset_fops);
+}  //npheap_debugfs_init()
 
 
 ////////////////////////////////////////////////////////////////////////
@@ -227,82 +2389,381 @@ return 1;
 // };
 
 
+// npheap_vm_open() takes a reference for a copied or split mapping.
+//
+// vma: the new area, vm_private_data holds the node
+//
+// returns: void
+static void npheap_vm_open(struct vm_area_struct *vma)
+{
+  struct mytype *node = vma->vm_private_data;
+
+  kref_get(&node->ref);
+}  //npheap_vm_open()
+
+
+// npheap_vm_close() drops a mapping's reference, freeing a deleted node
+// with its last mapping.
+//
+// vma: the area going away, vm_private_data holds the node
+//
+// returns: void
+static void npheap_vm_close(struct vm_area_struct *vma)
+{
+  npheap_put(vma->vm_private_data);
+}  //npheap_vm_close()
+
+
+// npheap_vm_fault() maps one page of an object on first touch.
+//
+// vmf: the fault, vm_private_data of its vma holds the node
+//
+// returns: VM_FAULT_NOPAGE once mapped, VM_FAULT_SIGBUS past the object's
+//          end, VM_FAULT_OOM if out of memory
+static vm_fault_t npheap_vm_fault(struct vm_fault *vmf)
+{
+  struct vm_area_struct *vma = vmf->vma;
+  struct mytype *node = vma->vm_private_data;
+  bool write = vmf->flags & FAULT_FLAG_WRITE;
+  vm_fault_t ret = VM_FAULT_SIGBUS;
+  struct page *page;
+
+  npheap_heat_fault(node);
+  npheap_count(NPHEAP_STAT_FAULT);
+  down_read(&freeze_sem);
+  mutex_lock(&node->lock);
+  if (vmf->pgoff - node->keystring < node->nr_pages) {
+    page = npheap_get_page(node, vmf->pgoff - node->keystring, write);
+
+    // Read faults map the page read-only so npheap_vm_pfn_mkwrite() sees
+    // the first write to it.
+    if (!page)
+      ret = VM_FAULT_OOM;
+    else if (write)
+      ret = vmf_insert_pfn_prot(vma, vmf->address, page_to_pfn(page),
+                                vm_get_page_prot(vma->vm_flags));
+    else
+      ret = vmf_insert_pfn(vma, vmf->address, page_to_pfn(page));
+  }
+  mutex_unlock(&node->lock);
+  up_read(&freeze_sem);
+  return ret;
+}  //npheap_vm_fault()
+
+
+// npheap_vm_pfn_mkwrite() handles the first write to a read-only mapped
+// page, marking it dirty or un-sharing it if it belongs to a clone as well.
+//
+// vmf: the fault, vm_private_data of its vma holds the node
+//
+// returns: 0 to make the mapping writable, VM_FAULT_NOPAGE to refault on
+//          the private copy, VM_FAULT_SIGBUS or VM_FAULT_OOM on failure
+static vm_fault_t npheap_vm_pfn_mkwrite(struct vm_fault *vmf)
+{
+  struct mytype *node = vmf->vma->vm_private_data;
+  unsigned long idx = vmf->pgoff - node->keystring;
+  vm_fault_t ret = VM_FAULT_SIGBUS;
+
+  npheap_heat_fault(node);
+  down_read(&freeze_sem);
+  mutex_lock(&node->lock);
+  if (idx < node->nr_pages) {
+    ret = 0;
+    if (test_bit(idx, node->cow) && !npheap_cow_reuse(node, idx))
+      ret = npheap_split_page(node, idx) ? VM_FAULT_OOM : VM_FAULT_NOPAGE;
+    else
+      set_bit(idx, node->dirty);
+  }
+  mutex_unlock(&node->lock);
+  up_read(&freeze_sem);
+  return ret;
+}  //npheap_vm_pfn_mkwrite()
+
+
+// npheap_populate() maps the pages behind part of a mapping up front, as
+// if each had been read. They are mapped read-only like on a read fault,
+// so npheap_vm_pfn_mkwrite() still sees the first real write to each and
+// only that marks it dirty or un-shares it. Caller holds the mmap lock of
+// vma's mm.
+//
+// vma: an npheap mapping, vm_private_data holds the node
+// start: address of the first page to map
+// end: address to stop at
+//
+// returns: 0 if successful or -ENOMEM
+static int npheap_populate(struct vm_area_struct *vma, unsigned long start,
+                           unsigned long end)
+{
+  struct mytype *node = vma->vm_private_data;
+  unsigned long addr, idx, nr = 0;
+  struct page *page;
+  int ret = 0;
+
+  down_read(&freeze_sem);
+  mutex_lock(&node->lock);
+  for (addr = start; addr < end; addr += PAGE_SIZE) {
+    idx = vma->vm_pgoff - node->keystring +
+          ((addr - vma->vm_start) >> PAGE_SHIFT);
+    if (idx >= node->nr_pages)
+      break;
+    page = npheap_get_page(node, idx, false);
+    if (!page ||
+        vmf_insert_pfn(vma, addr, page_to_pfn(page)) != VM_FAULT_NOPAGE) {
+      ret = -ENOMEM;
+      break;
+    }
+    nr++;
+    cond_resched();
+  }
+  mutex_unlock(&node->lock);
+  up_read(&freeze_sem);
+  npheap_count_add(NPHEAP_STAT_PREFAULT, nr);
+  return ret;
+}  //npheap_populate()
+
+
+static const struct vm_operations_struct npheap_vm_ops = {
+  .open = npheap_vm_open,
+  .close = npheap_vm_close,
+  .fault = npheap_vm_fault,
+  .pfn_mkwrite = npheap_vm_pfn_mkwrite,
+};
+
+
+// npheap_vm_populate_fault() maps the faulting page, then the rest of a
+// locked or prefault mapping along with it. The mapping then goes back to
+// npheap_vm_ops, so pages zapped later are faulted back one at a time.
+//
+// vmf: the fault, vm_private_data of its vma holds the node
+//
+// returns: what npheap_vm_fault() returns
+static vm_fault_t npheap_vm_populate_fault(struct vm_fault *vmf)
+{
+  struct vm_area_struct *vma = vmf->vma;
+  vm_fault_t ret = npheap_vm_fault(vmf);
+
+  if (ret == VM_FAULT_NOPAGE) {
+    // Only the fault handler differs, so a racing fault that still sees
+    // the old ops at worst populates the mapping a second time.
+    WRITE_ONCE(vma->vm_ops, &npheap_vm_ops);
+    npheap_populate(vma, vma->vm_start, vma->vm_end);
+  }
+  return ret;
+}  //npheap_vm_populate_fault()
+
+
+static const struct vm_operations_struct npheap_populate_vm_ops = {
+  .open = npheap_vm_open,
+  .close = npheap_vm_close,
+  .fault = npheap_vm_populate_fault,
+  .pfn_mkwrite = npheap_vm_pfn_mkwrite,
+};
+
+
 // npheap_mmap() creates a new mapping in the virtual address space of the
-// calling process.
+// calling process. Pages are mapped on demand by npheap_vm_fault(), or all
+// at once on the first fault of a locked mapping (MAP_LOCKED, mlockall())
+// or of an object created with NPHEAP_CREATE_PREFAULT.
 //
-// filp: unused
+// filp: the device file, its address space is remembered for npheap_zap()
 // vma: the memory VMM memory area we are creating or mapping to
 //
-// returns: 0 if successful [TODO] maybe more
+// returns: 0 if successful, -EINVAL for a private mapping, -ENOMEM, the
+//          errors of npheap_may_create() for a new object or those of
+//          npheap_dir_mmap() at NPHEAP_DIR_OFFSET
 int npheap_mmap(struct file *filp, struct vm_area_struct *vma)
 {
     unsigned long offset = vma->vm_pgoff; // already calculated in user library
     unsigned long size = vma->vm_end - vma->vm_start;
-    struct mytype *new_node = my_search(&mytree, offset);
+    struct mytype *new_node;
+    u64 start = ktime_get_ns();
+    bool prefault;
+
+    if (offset == NPHEAP_DIR_OFFSET >> PAGE_SHIFT)
+      return npheap_dir_mmap(vma);
+    npheap_count(NPHEAP_STAT_MMAP);
+
+    // Pages may be shared between clones, a private copy would bypass that.
+    if (!(vma->vm_flags & VM_SHARED))
+      return -EINVAL;
+
+    mutex_lock(&tree_lock);
+    new_node = my_search(&mytree, offset);
 
     // If it's not already there, allocate space and insert into rb tree.
     if (new_node == NULL) {
-      printk("Inside mmap creating new node\n");
-      new_node = kmalloc(sizeof(struct mytype), GFP_KERNEL);
-      printk("kmalloc successful\n");
-      new_node->keystring = offset;
-      //new_node->node_cmd.op = 1;   // [TODO] does this need to be used?
-      new_node->node_cmd.offset = offset;
-      new_node->node_cmd.size = size;
-      new_node->node_cmd.data = kmalloc(size, GFP_KERNEL);
-
-      printk("reached remap\n");
-      remap_pfn_range(vma,
-                      vma->vm_start,
-                      virt_to_phys((void *)(new_node->node_cmd.data))
-                        >> PAGE_SHIFT,
-                      size,
-                      vma->vm_page_prot);
-      my_insert(&mytree, new_node);
+      int err = npheap_may_create(size);
 
+      if (err) {
+        mutex_unlock(&tree_lock);
+        return err;
+      }
+      new_node = npheap_new_node(offset, size);
+      if (new_node == NULL) {
+        mutex_unlock(&tree_lock);
+        return -ENOMEM;
+      }
+      npheap_set_expiry(new_node, default_ttl);
+      my_insert(&mytree, new_node);
+      npheap_linked(new_node);
+      npheap_created(new_node, start);
     }
-    // Else it is there so remap it
-    else {
-      printk("Inside mmap mapping existing node\n");
-      remap_pfn_range(vma,
-                      vma->vm_start,
-                      virt_to_phys((void *)(new_node->node_cmd.data))
-                        >> PAGE_SHIFT,
-                      size,
-                      vma->vm_page_prot);
-    }
-    printk("reached return\n");
+
+    // The mapping keeps the node alive even after it is deleted.
+    kref_get(&new_node->ref);
+    prefault = new_node->prefault;
+    mutex_unlock(&tree_lock);
+
+    WRITE_ONCE(npheap_mapping, filp->f_mapping);
+    vma->vm_flags |= VM_PFNMAP | VM_DONTEXPAND | VM_DONTDUMP;
+    vma->vm_private_data = new_node;
+
+    // The core never populates a PFN mapping itself, and mapping pages from
+    // here would put them in before the area is linked where npheap_zap()
+    // and snapshots find it. Its first fault populates it instead.
+    if (prefault || (vma->vm_flags & VM_LOCKED))
+      vma->vm_ops = &npheap_populate_vm_ops;
+    else
+      vma->vm_ops = &npheap_vm_ops;
+    start = ktime_get_ns() - start;  //now the latency
+    npheap_hist_add(NPHEAP_HIST_MMAP, start);
+    trace_npheap_map((u64)offset << PAGE_SHIFT, new_node->node_cmd.size, start);
     return 0;
 }  //npheap_mmap()
 
 
-// npheap_init() shouldn't be changed.
+// npheap_fadvise() populates the calling process's mappings of the device
+// range on POSIX_FADV_WILLNEED, which is also where madvise(MADV_WILLNEED)
+// on an npheap mapping ends up. Other advice has no meaning here.
+//
+// filp: the device file
+// offset: byte offset of the range on the device
+// len: length of the range, 0 for all of the device from offset
+// advice: the POSIX_FADV_* advice
+//
+// returns: 0 if successful, -EINVAL for bad advice or -ENOMEM
+int npheap_fadvise(struct file *filp, loff_t offset, loff_t len, int advice)
+{
+  struct mm_struct *mm = current->mm;
+  struct vm_area_struct *vma;
+  unsigned long first, last, from, to;
+  int ret = 0;
+
+  if (advice != POSIX_FADV_WILLNEED)
+    return generic_fadvise(filp, offset, len, advice);
+  if (offset < 0 || len < 0)
+    return -EINVAL;
+  if (!mm)
+    return 0;
+
+  first = offset >> PAGE_SHIFT;
+  last = len && offset + len > offset ? (offset + len - 1) >> PAGE_SHIFT
+                                      : ULONG_MAX;
+  mmap_read_lock(mm);
+  for (vma = find_vma(mm, 0); vma && !ret; vma = find_vma(mm, vma->vm_end)) {
+    if ((vma->vm_ops != &npheap_vm_ops &&
+         vma->vm_ops != &npheap_populate_vm_ops) ||
+        vma->vm_pgoff > last || vma->vm_pgoff + vma_pages(vma) <= first)
+      continue;
+    from = vma->vm_start;
+    if (first > vma->vm_pgoff)
+      from += (first - vma->vm_pgoff) << PAGE_SHIFT;
+    to = vma->vm_end;
+    if (last - vma->vm_pgoff < vma_pages(vma) - 1)
+      to = vma->vm_start + ((last - vma->vm_pgoff + 1) << PAGE_SHIFT);
+    ret = npheap_populate(vma, from, to);
+  }
+  mmap_read_unlock(mm);
+  return ret;
+}  //npheap_fadvise()
+
+
+// npheap_init() sets up the expiry wheel, runs the selftest if asked to,
+// adopts the objects of the module we replace, restores a checkpoint if
+// asked to and registers the device, its debugfs statistics and the long
+// hold watchdog. If the device cannot be registered, the objects are parked
+// again, or freed, as on unload.
 int npheap_init(void)
 {
-    int ret;
-    if ((ret = misc_register(&npheap_dev)))
+    int ret, i;
+
+    generation = ktime_get_real_ns();
+    for (i = 0; i < NPHEAP_TTL_SLOTS; i++)
+      INIT_LIST_HEAD(&ttl_wheel[i]);
+    if (selftest)
+      npheap_selftest(selftest);
+    npheap_dir_init();
+    npheap_adopt();
+    if (restore)
+      npheap_restore_path(restore);
+    if ((ret = misc_register(&npheap_dev))) {
         printk(KERN_ERR "Unable to register \"npheap\" misc device\n");
-    else
-        printk(KERN_ERR "\"npheap\" misc device installed\n");
-    return ret;
+        cancel_delayed_work_sync(&ttl_work);
+        flush_work(&free_work);
+        if (!npheap_park())
+          npheap_teardown();
+        vfree(dir);
+        dir = NULL;
+        return ret;
+    }
+    printk(KERN_ERR "\"npheap\" misc device installed\n");
+    npheap_debugfs_init();
+    schedule_delayed_work(&hold_work, round_jiffies_relative(HZ));
+    return 0;
 }  //npheap_init()
 
 
-// npheap_exit() shouldn't be changed.
+// npheap_exit() removes the debugfs statistics, deregisters the device,
+// stops the background workers and parks the objects for the next
+// npheap.ko if npheap_handoff.ko is loaded, or frees them all otherwise.
 void npheap_exit(void)
 {
+    debugfs_remove_recursive(debugfs_dir);
     misc_deregister(&npheap_dev);
+    cancel_delayed_work_sync(&ttl_work);
+    cancel_delayed_work_sync(&hold_work);
+    flush_work(&free_work);
+    if (!npheap_park())
+      npheap_teardown();
+    vfree(dir);
 }  //npheap_exit()
 
 
 // npheap_lock() aquires the mutex lock when available.
 //
-// user_cmd: unused
+// user_cmd: offset names the object the lock is taken for, see hot_keys
 //
 // returns: 0 when lock aquired
 long npheap_lock(struct npheap_cmd __user *user_cmd)
 {
-  mutex_lock(&np_lock);
+  u64 start = ktime_get_ns(), now;
+  bool contended, sampled, named;
+  __u64 offset = 0;
+
+  // Read the offset before taking the lock, it may fault, so lock_holder
+  // and held_long can always name the object.
+  named = !get_user(offset, &user_cmd->offset);
+  contended = !mutex_trylock(&np_lock);
+  if (contended) {
+    trace_npheap_lock_contend(READ_ONCE(lock_holder));
+    mutex_lock(&np_lock);
+  }
+  now = ktime_get_ns();
+  npheap_hist_add(NPHEAP_HIST_LOCK_WAIT, now - start);
+  trace_npheap_lock_acquire(now - start);
+  npheap_count(NPHEAP_STAT_LOCK);
+
+  sampled = static_branch_likely(&stats_enabled) && npheap_sampled();
+  spin_lock(&holder_lock);
+  lock_holder = task_tgid_nr(current);
+  lock_acquired = now;
+  lock_wait = now - start;
+  lock_contended = contended;
+  lock_offset = offset;
+  lock_named = named;
+  lock_sampled = sampled;
+  lock_reported = false;
+  spin_unlock(&holder_lock);
     return 0;
 }  //npheap_lock()
 
@@ -314,6 +2775,19 @@ long npheap_lock(struct npheap_cmd __user *user_cmd)
 // returns: 0 when lock released
 long npheap_unlock(struct npheap_cmd __user *user_cmd)
 {
+  u64 hold = ktime_get_ns() - lock_acquired;
+  bool reported;
+  pid_t pid;
+
+  npheap_hist_add(NPHEAP_HIST_LOCK_HOLD, hold);
+  trace_npheap_lock_release(hold);
+  spin_lock(&holder_lock);
+  pid = lock_holder;
+  reported = lock_reported;
+  lock_holder = 0;
+  spin_unlock(&holder_lock);
+  npheap_lock_released(pid, hold, reported);
+  npheap_count(NPHEAP_STAT_UNLOCK);
   mutex_unlock(&np_lock);
     return 0;
 }  //npheap_unlock()
@@ -329,24 +2803,59 @@ long npheap_getsize(struct npheap_cmd __user *user_cmd)
   //Create a temp node ptr and copy the user command over.
   struct mytype *getsize_node;
   struct npheap_cmd *cmd = kmalloc(sizeof(struct npheap_cmd), GFP_KERNEL);
+  u64 start = ktime_get_ns();
+  u64 offset;
+  long size = 0;
+
   copy_from_user(cmd, user_cmd, sizeof(struct npheap_cmd));
+  npheap_count(NPHEAP_STAT_GETSIZE);
 
   //Search the rb tree for our node and assign it to temp node ptr. Free mem.
+  mutex_lock(&tree_lock);
   getsize_node = my_search(&mytree, cmd->offset / PAGE_SIZE);
+  offset = cmd->offset;
   kfree(cmd);
 
-  printk("inside getsize\n");
-
   //If we don't find it, return 0. Otherwise return it's size.
-  if (getsize_node == NULL)
-    return 0;
-  else{
-    printk("found\n");
-    return getsize_node->node_cmd.size;
-  }
+  if (getsize_node != NULL)
+    size = getsize_node->node_cmd.size;
+  mutex_unlock(&tree_lock);
+  trace_npheap_getsize(offset, size, ktime_get_ns() - start);
+  return size;
 }  //npheap_getsize()
 
 
+// npheap_next() finds the first node at or after an offset, so the heap
+// can be walked in offset order.
+//
+// user_cmd: offset to start at, replaced by the offset of the node found,
+//           op gets its generation
+//
+// returns: the size of the node found, 0 if there is none, -EFAULT
+long npheap_next(struct npheap_cmd __user *user_cmd)
+{
+  struct npheap_cmd cmd;
+  struct mytype *node;
+  long size = 0;
+
+  if (copy_from_user(&cmd, user_cmd, sizeof(struct npheap_cmd)))
+    return -EFAULT;
+
+  mutex_lock(&tree_lock);
+  node = my_search_from(&mytree, DIV_ROUND_UP(cmd.offset, PAGE_SIZE));
+  if (node) {
+    cmd.offset = (__u64)node->keystring << PAGE_SHIFT;
+    cmd.op = node->generation;
+    size = node->node_cmd.size;
+  }
+  mutex_unlock(&tree_lock);
+
+  if (size && copy_to_user(user_cmd, &cmd, sizeof(struct npheap_cmd)))
+    return -EFAULT;
+  return size;
+}  //npheap_next()
+
+
 // npheap_delete() deletes a node into the rb tree.
 //
 // user_cmd: the struct we need to find and delete/free
@@ -357,16 +2866,27 @@ long npheap_delete(struct npheap_cmd __user *user_cmd)
     //Create a temp node ptr and copy user command.
     struct mytype *delete_node;
     struct npheap_cmd *cmd = kmalloc(sizeof(struct npheap_cmd), GFP_KERNEL);
+    u64 start = ktime_get_ns();
+    u64 size = 0;
     copy_from_user(cmd, user_cmd, sizeof(struct npheap_cmd));
 
     //Search for the node in the rb tree.
+    mutex_lock(&tree_lock);
     delete_node = my_search(&mytree, cmd->offset / PAGE_SIZE);
 
     //If we found it, delete it from tree and the other mem.
+    npheap_count(NPHEAP_STAT_DELETE);
+    if (delete_node) {
+      size = delete_node->node_cmd.size;
+      npheap_unlink(delete_node);
+    }
+    mutex_unlock(&tree_lock);
+
+    //Its memory goes on the free worker once the last process mapping it
+    //unmaps it, so we return as soon as it is unlinked.
     if (delete_node) {
-    	rb_erase(&delete_node->node, &mytree);
-      kfree(delete_node->node_cmd.data);
-    	kfree(delete_node);
+      npheap_put(delete_node);
+      npheap_deleted(cmd->offset, size, start);
     }
     //Free copied user data.
     kfree(cmd);
@@ -374,7 +2894,527 @@ long npheap_delete(struct npheap_cmd __user *user_cmd)
 }  //npheap_delete()
 
 
-// npheap_ioctl() shouldn't be changed.
+// npheap_delete_range() deletes every node with a key in [start, end).
+//
+// user_cmd: offset is the start of the range and size its length in bytes
+//
+// returns: the number of objects deleted, -EFAULT on a bad user_cmd or
+//          -EINVAL for a range running past the end of the key space
+long npheap_delete_range(struct npheap_cmd __user *user_cmd)
+{
+  struct npheap_cmd cmd;
+  struct mytype *node, *next;
+  unsigned long start, end;
+  u64 t, offset, size;
+  long deleted = 0;
+
+  if (copy_from_user(&cmd, user_cmd, sizeof(struct npheap_cmd)))
+    return -EFAULT;
+
+  // A wrapped range is more likely an inverted one than meant to delete
+  // everything from offset up.
+  if (cmd.offset + cmd.size < cmd.offset)
+    return -EINVAL;
+  start = cmd.offset / PAGE_SIZE;
+  end = (cmd.offset + cmd.size) / PAGE_SIZE;
+
+  // Unlink the whole range in key order, leave the freeing to the worker.
+  mutex_lock(&tree_lock);
+  node = my_search_from(&mytree, start);
+  while (node && node->keystring < end) {
+    next = rb_entry_safe(rb_next(&node->node), struct mytype, node);
+    t = ktime_get_ns();
+    offset = (u64)node->keystring << PAGE_SHIFT;
+    size = node->node_cmd.size;
+    npheap_unlink(node);
+    npheap_put(node);
+    npheap_count(NPHEAP_STAT_DELETE);
+    npheap_deleted(offset, size, t);
+    deleted++;
+    node = next;
+  }
+  mutex_unlock(&tree_lock);
+  return deleted;
+}  //npheap_delete_range()
+
+
+// npheap_set_ttl() gives an existing node a new time to live.
+//
+// user_cmd: offset names the node and size is its ttl in seconds (0 clears)
+//
+// returns: 0 if successful, -ENOENT if there is no such node
+long npheap_set_ttl(struct npheap_cmd __user *user_cmd)
+{
+  struct npheap_cmd cmd;
+  struct mytype *node;
+
+  if (copy_from_user(&cmd, user_cmd, sizeof(struct npheap_cmd)))
+    return -EFAULT;
+
+  mutex_lock(&tree_lock);
+  node = my_search(&mytree, cmd.offset / PAGE_SIZE);
+  if (node)
+    npheap_set_expiry(node, cmd.size);
+  mutex_unlock(&tree_lock);
+  return node ? 0 : -ENOENT;
+}  //npheap_set_ttl()
+
+
+// npheap_clone() creates a node sharing all of another node's pages. Each
+// shared page is copied by whichever side writes it first.
+//
+// user_cmd: the offsets of the source node and of the clone to create
+//
+// returns: 0 if successful, -ENOENT without a source, -EEXIST if the clone
+//          offset is taken, -ENOMEM, or the errors of npheap_may_create()
+long npheap_clone(struct npheap_clone_cmd __user *user_cmd)
+{
+  struct npheap_clone_cmd cmd;
+  struct mytype *src, *dst;
+  u64 start = ktime_get_ns();
+  long ret = 0;
+
+  if (copy_from_user(&cmd, user_cmd, sizeof(struct npheap_clone_cmd)))
+    return -EFAULT;
+
+  mutex_lock(&tree_lock);
+  src = my_search(&mytree, cmd.src_offset / PAGE_SIZE);
+  if (!src) {
+    ret = -ENOENT;
+    goto out;
+  }
+  if (my_search(&mytree, cmd.dst_offset / PAGE_SIZE)) {
+    ret = -EEXIST;
+    goto out;
+  }
+  ret = npheap_may_create(src->node_cmd.size);
+  if (ret)
+    goto out;
+  dst = npheap_new_node(cmd.dst_offset / PAGE_SIZE, src->node_cmd.size);
+  if (!dst) {
+    ret = -ENOMEM;
+    goto out;
+  }
+
+  // Write-protect the source so its next write to a shared page faults.
+  mutex_lock(&src->lock);
+  npheap_share_pages(src, dst);
+  npheap_zap(src, 0, src->nr_pages);
+  mutex_unlock(&src->lock);
+
+  npheap_set_expiry(dst, default_ttl);
+  my_insert(&mytree, dst);
+  npheap_linked(dst);
+  npheap_created(dst, start);
+out:
+  mutex_unlock(&tree_lock);
+  return ret;
+}  //npheap_clone()
+
+
+// npheap_get_dirty() returns which pages of a node were written since the
+// last call and starts a new sync point. Written pages are write-protected
+// again so their next write is seen.
+//
+// user_cmd: offset names the node, data points to a bitmap of size bytes
+//           that gets bit i set if page i was written
+//
+// returns: the number of dirty pages, -ENOENT if there is no such node,
+//          -EFAULT, -ENOMEM
+long npheap_get_dirty(struct npheap_cmd __user *user_cmd)
+{
+  struct npheap_cmd cmd;
+  struct mytype *node;
+  unsigned long *dirty = NULL;
+  unsigned long first, last, nbytes = 0;
+  long ret;
+
+  if (copy_from_user(&cmd, user_cmd, sizeof(struct npheap_cmd)))
+    return -EFAULT;
+
+  mutex_lock(&tree_lock);
+  node = my_search(&mytree, cmd.offset / PAGE_SIZE);
+  if (!node) {
+    ret = -ENOENT;
+    goto out;
+  }
+  nbytes = BITS_TO_LONGS(node->nr_pages) * sizeof(unsigned long);
+  mutex_lock(&node->lock);
+  dirty = kvmalloc(nbytes, GFP_KERNEL);
+  if (!dirty) {
+    mutex_unlock(&node->lock);
+    ret = -ENOMEM;
+    goto out;
+  }
+  memcpy(dirty, node->dirty, nbytes);
+  ret = bitmap_weight(dirty, node->nr_pages);
+  bitmap_zero(node->dirty, node->nr_pages);
+
+  // Write-protect each run of dirty pages.
+  for (first = find_first_bit(dirty, node->nr_pages); first < node->nr_pages;
+       first = find_next_bit(dirty, node->nr_pages, last)) {
+    last = find_next_zero_bit(dirty, node->nr_pages, first);
+    npheap_zap(node, first, last - first);
+  }
+  mutex_unlock(&node->lock);
+out:
+  mutex_unlock(&tree_lock);
+
+  // Copy out only once tree_lock is dropped, data may be a heap mapping.
+  if (dirty && copy_to_user((void __user *)cmd.data, dirty,
+                            min_t(u64, cmd.size, nbytes)))
+    ret = -EFAULT;
+  kvfree(dirty);
+  return ret;
+}  //npheap_get_dirty()
+
+
+// npheap_new_token() picks an unused key for an object created by id.
+// Caller holds tree_lock.
+//
+// returns: the key, whose byte offset is the token to mmap the object at
+static unsigned long npheap_new_token(void)
+{
+  unsigned long token;
+
+  // Legacy users may have mapped an offset in the token range themselves.
+  while (my_search(&mytree, next_token))
+    next_token = next_token < NPHEAP_TOKEN_LAST ? next_token + 1
+                                                : NPHEAP_TOKEN_FIRST;
+  token = next_token;
+  next_token = token < NPHEAP_TOKEN_LAST ? token + 1 : NPHEAP_TOKEN_FIRST;
+  return token;
+}  //npheap_new_token()
+
+
+// npheap_create() creates an object named by a 64-bit id at a mapping
+// offset of the kernel's choosing, or finds the one of that id.
+//
+// user_cmd: id, size and flags of the object, token and size get filled in
+//
+// returns: 0 if successful, -EINVAL for a size of 0 or unknown flags,
+//          -ENOMEM, -EFAULT, or the errors of npheap_may_create()
+long npheap_create(struct npheap_id_cmd __user *user_cmd)
+{
+  struct npheap_id_cmd cmd;
+  struct mytype *node;
+  u64 start = ktime_get_ns();
+  long ret = 0;
+
+  if (copy_from_user(&cmd, user_cmd, sizeof(struct npheap_id_cmd)))
+    return -EFAULT;
+  if (cmd.flags & ~(__u64)NPHEAP_CREATE_PREFAULT)
+    return -EINVAL;
+
+  mutex_lock(&tree_lock);
+  node = npheap_id_search(&idtree, cmd.id);
+  if (!node) {
+    if (!cmd.size) {
+      ret = -EINVAL;
+      goto out;
+    }
+    ret = npheap_may_create(cmd.size);
+    if (ret)
+      goto out;
+    node = npheap_new_node(npheap_new_token(), cmd.size);
+    if (!node) {
+      ret = -ENOMEM;
+      goto out;
+    }
+    node->has_id = true;
+    node->id = cmd.id;
+    npheap_id_insert(&idtree, node);
+    npheap_set_expiry(node, default_ttl);
+    my_insert(&mytree, node);
+    npheap_linked(node);
+    npheap_created(node, start);
+  }
+  if (cmd.flags & NPHEAP_CREATE_PREFAULT)
+    node->prefault = true;
+  cmd.token = (__u64)node->keystring << PAGE_SHIFT;
+  cmd.size = node->node_cmd.size;
+out:
+  mutex_unlock(&tree_lock);
+
+  if (!ret && copy_to_user(user_cmd, &cmd, sizeof(struct npheap_id_cmd)))
+    ret = -EFAULT;
+  return ret;
+}  //npheap_create()
+
+
+// npheap_lookup() finds where to map the object of an id.
+//
+// user_cmd: id of the object, token and size get filled in
+//
+// returns: 0 if successful, -ENOENT if there is no such object, -EFAULT
+long npheap_lookup(struct npheap_id_cmd __user *user_cmd)
+{
+  struct npheap_id_cmd cmd;
+  struct mytype *node;
+
+  if (copy_from_user(&cmd, user_cmd, sizeof(struct npheap_id_cmd)))
+    return -EFAULT;
+
+  mutex_lock(&tree_lock);
+  node = npheap_id_search(&idtree, cmd.id);
+  if (node) {
+    cmd.token = (__u64)node->keystring << PAGE_SHIFT;
+    cmd.size = node->node_cmd.size;
+  }
+  mutex_unlock(&tree_lock);
+
+  if (!node)
+    return -ENOENT;
+  if (copy_to_user(user_cmd, &cmd, sizeof(struct npheap_id_cmd)))
+    return -EFAULT;
+  return 0;
+}  //npheap_lookup()
+
+
+// npheap_delete_id() deletes the object of an id, see npheap_delete().
+//
+// user_cmd: id of the object
+//
+// returns: 0 if successful, -ENOENT if there is no such object, -EFAULT
+long npheap_delete_id(struct npheap_id_cmd __user *user_cmd)
+{
+  struct npheap_id_cmd cmd;
+  struct mytype *node;
+  u64 start = ktime_get_ns();
+
+  if (copy_from_user(&cmd, user_cmd, sizeof(struct npheap_id_cmd)))
+    return -EFAULT;
+
+  mutex_lock(&tree_lock);
+  node = npheap_id_search(&idtree, cmd.id);
+  npheap_count(NPHEAP_STAT_DELETE);
+  if (node) {
+    cmd.token = (__u64)node->keystring << PAGE_SHIFT;
+    cmd.size = node->node_cmd.size;
+    npheap_unlink(node);
+  }
+  mutex_unlock(&tree_lock);
+
+  if (!node)
+    return -ENOENT;
+  npheap_put(node);
+  npheap_deleted(cmd.token, cmd.size, start);
+  return 0;
+}  //npheap_delete_id()
+
+
+// npheap_set_checksum() turns checksumming of a node at unlock on or off.
+//
+// user_cmd: offset names the node, size is 1 to turn it on and 0 for off
+//
+// returns: 0 if successful, -ENOENT if there is no such node, -EFAULT
+long npheap_set_checksum(struct npheap_cmd __user *user_cmd)
+{
+  struct npheap_cmd cmd;
+  struct mytype *node;
+
+  if (copy_from_user(&cmd, user_cmd, sizeof(struct npheap_cmd)))
+    return -EFAULT;
+
+  mutex_lock(&tree_lock);
+  node = my_search(&mytree, cmd.offset / PAGE_SIZE);
+  if (node) {
+    if (node->checksummed != !!cmd.size) {
+      if (cmd.size)
+        nr_checksummed++;
+      else
+        nr_checksummed--;
+    }
+    mutex_lock(&node->lock);
+    node->checksummed = cmd.size;
+    node->crc_valid = false;
+    mutex_unlock(&node->lock);
+  }
+  mutex_unlock(&tree_lock);
+  return node ? 0 : -ENOENT;
+}  //npheap_set_checksum()
+
+
+// npheap_verify() checks a node against the checksum taken when the heap
+// lock naming it was last released. Callers should hold the heap lock so
+// no write is in flight.
+//
+// user_cmd: offset names the node
+//
+// returns: 0 if it matches, -EBADMSG if it doesn't, -ENODATA if it has no
+//          checksum yet, -ENOENT if there is no such node, -EFAULT
+long npheap_verify(struct npheap_cmd __user *user_cmd)
+{
+  struct npheap_cmd cmd;
+  struct mytype *node;
+  long ret = -ENODATA;
+
+  if (copy_from_user(&cmd, user_cmd, sizeof(struct npheap_cmd)))
+    return -EFAULT;
+
+  mutex_lock(&tree_lock);
+  node = my_search(&mytree, cmd.offset / PAGE_SIZE);
+  if (node)
+    kref_get(&node->ref);
+  mutex_unlock(&tree_lock);
+  if (!node)
+    return -ENOENT;
+
+  mutex_lock(&node->lock);
+  if (node->crc_valid)
+    ret = npheap_checksum(node) == node->crc ? 0 : -EBADMSG;
+  mutex_unlock(&node->lock);
+  npheap_put(node);
+
+  if (ret == -EBADMSG)
+    printk_ratelimited(KERN_WARNING
+                       "npheap: object at offset %llu fails its checksum\n",
+                       cmd.offset);
+  return ret;
+}  //npheap_verify()
+
+
+// npheap_set_tag() tags or untags a node.
+//
+// user_cmd: offset names the node, tag is its new tag or 0 for none
+//
+// returns: 0 if successful, -ENOENT if there is no such node, -EFAULT
+long npheap_set_tag(struct npheap_tag_cmd __user *user_cmd)
+{
+  struct npheap_tag_cmd cmd;
+  struct mytype *node;
+
+  if (copy_from_user(&cmd, user_cmd, sizeof(struct npheap_tag_cmd)))
+    return -EFAULT;
+
+  mutex_lock(&tree_lock);
+  node = my_search(&mytree, cmd.offset / PAGE_SIZE);
+  if (node) {
+    if (node->tag)
+      rb_erase(&node->tag_node, &tagtree);
+    node->tag = cmd.tag;
+    if (node->tag)
+      npheap_tag_insert(&tagtree, node);
+  }
+  mutex_unlock(&tree_lock);
+  return node ? 0 : -ENOENT;
+}  //npheap_set_tag()
+
+
+// npheap_tag_list() lists the offsets of the nodes with a tag.
+//
+// user_cmd: tag names the nodes, offsets has room for count offsets, count
+//           is replaced by the number of nodes with the tag
+//
+// returns: the number of offsets copied, -EINVAL for tag 0, -ENOMEM,
+//          -EFAULT
+long npheap_tag_list(struct npheap_tag_cmd __user *user_cmd)
+{
+  struct npheap_tag_cmd cmd;
+  struct mytype *node;
+  __u64 *offsets = NULL;
+  u64 room, found = 0;
+  long ret;
+
+  if (copy_from_user(&cmd, user_cmd, sizeof(struct npheap_tag_cmd)))
+    return -EFAULT;
+  if (!cmd.tag)
+    return -EINVAL;
+
+  // Gather under tree_lock, copy out once it is dropped.
+  room = min_t(u64, cmd.count, READ_ONCE(nr_objects));
+  if (room) {
+    offsets = kvmalloc_array(room, sizeof(__u64), GFP_KERNEL);
+    if (!offsets)
+      return -ENOMEM;
+  }
+  mutex_lock(&tree_lock);
+  for (node = npheap_tag_first(&tagtree, cmd.tag); node;
+       node = npheap_tag_next(node)) {
+    if (found < room)
+      offsets[found] = (__u64)node->keystring << PAGE_SHIFT;
+    found++;
+  }
+  mutex_unlock(&tree_lock);
+
+  ret = min(found, room);
+  cmd.count = found;
+  if ((ret && copy_to_user((void __user *)cmd.offsets, offsets,
+                           ret * sizeof(__u64))) ||
+      copy_to_user(user_cmd, &cmd, sizeof(struct npheap_tag_cmd)))
+    ret = -EFAULT;
+  kvfree(offsets);
+  return ret;
+}  //npheap_tag_list()
+
+
+// npheap_tag_getsize() sums the sizes of the nodes with a tag.
+//
+// user_cmd: tag names the nodes, count and bytes are replaced by their
+//           number and total size
+//
+// returns: 0 if successful, -EINVAL for tag 0, -EFAULT
+long npheap_tag_getsize(struct npheap_tag_cmd __user *user_cmd)
+{
+  struct npheap_tag_cmd cmd;
+  struct mytype *node;
+
+  if (copy_from_user(&cmd, user_cmd, sizeof(struct npheap_tag_cmd)))
+    return -EFAULT;
+  if (!cmd.tag)
+    return -EINVAL;
+
+  cmd.count = 0;
+  cmd.bytes = 0;
+  mutex_lock(&tree_lock);
+  for (node = npheap_tag_first(&tagtree, cmd.tag); node;
+       node = npheap_tag_next(node)) {
+    cmd.count++;
+    cmd.bytes += node->node_cmd.size;
+  }
+  mutex_unlock(&tree_lock);
+
+  if (copy_to_user(user_cmd, &cmd, sizeof(struct npheap_tag_cmd)))
+    return -EFAULT;
+  return 0;
+}  //npheap_tag_getsize()
+
+
+// npheap_tag_delete() deletes every node with a tag, see npheap_delete().
+//
+// user_cmd: tag names the nodes
+//
+// returns: the number of objects deleted, -EINVAL for tag 0, -EFAULT
+long npheap_tag_delete(struct npheap_tag_cmd __user *user_cmd)
+{
+  struct npheap_tag_cmd cmd;
+  struct mytype *node, *next;
+  u64 start, offset, size;
+  long deleted = 0;
+
+  if (copy_from_user(&cmd, user_cmd, sizeof(struct npheap_tag_cmd)))
+    return -EFAULT;
+  if (!cmd.tag)
+    return -EINVAL;
+
+  mutex_lock(&tree_lock);
+  for (node = npheap_tag_first(&tagtree, cmd.tag); node; node = next) {
+    next = npheap_tag_next(node);
+    start = ktime_get_ns();
+    offset = (u64)node->keystring << PAGE_SHIFT;
+    size = node->node_cmd.size;
+    npheap_unlink(node);
+    npheap_put(node);
+    npheap_count(NPHEAP_STAT_DELETE);
+    npheap_deleted(offset, size, start);
+    deleted++;
+  }
+  mutex_unlock(&tree_lock);
+  return deleted;
+}  //npheap_tag_delete()
+
+
+// npheap_ioctl() dispatches a command on the device to its handler.
 long npheap_ioctl(struct file *filp, unsigned int cmd,
                                 unsigned long arg)
 {
@@ -387,6 +3427,38 @@ long npheap_ioctl(struct file *filp, unsigned int cmd,
         return npheap_getsize((void __user *) arg);
     case NPHEAP_IOCTL_DELETE:
         return npheap_delete((void __user *) arg);
+    case NPHEAP_IOCTL_DELETE_RANGE:
+        return npheap_delete_range((void __user *) arg);
+    case NPHEAP_IOCTL_SET_TTL:
+        return npheap_set_ttl((void __user *) arg);
+    case NPHEAP_IOCTL_CLONE:
+        return npheap_clone((void __user *) arg);
+    case NPHEAP_IOCTL_GET_DIRTY:
+        return npheap_get_dirty((void __user *) arg);
+    case NPHEAP_IOCTL_NEXT:
+        return npheap_next((void __user *) arg);
+    case NPHEAP_IOCTL_CREATE:
+        return npheap_create((void __user *) arg);
+    case NPHEAP_IOCTL_LOOKUP:
+        return npheap_lookup((void __user *) arg);
+    case NPHEAP_IOCTL_DELETE_ID:
+        return npheap_delete_id((void __user *) arg);
+    case NPHEAP_IOCTL_SET_CHECKSUM:
+        return npheap_set_checksum((void __user *) arg);
+    case NPHEAP_IOCTL_VERIFY:
+        return npheap_verify((void __user *) arg);
+    case NPHEAP_IOCTL_SET_TAG:
+        return npheap_set_tag((void __user *) arg);
+    case NPHEAP_IOCTL_TAG_LIST:
+        return npheap_tag_list((void __user *) arg);
+    case NPHEAP_IOCTL_TAG_GETSIZE:
+        return npheap_tag_getsize((void __user *) arg);
+    case NPHEAP_IOCTL_TAG_DELETE:
+        return npheap_tag_delete((void __user *) arg);
+    case NPHEAP_IOCTL_SNAPSHOT:
+        return npheap_snapshot();
+    case NPHEAP_IOCTL_RESTORE:
+        return npheap_restore_fd(arg);
     default:
         return -ENOTTY;
     }
@@ -1,6 +1,7 @@
 #include "npheap.h"
 #include <npheap/npheap.h>
 #include <stdio.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <sys/ioctl.h>
 #include <fcntl.h>
@@ -33,9 +34,312 @@ int npheap_delete(int devfd, __u64 offset)
      return ioctl(devfd, NPHEAP_IOCTL_DELETE, &cmd);
 }
 
+/* The metadata directory is the same for every fd of the device, so it is
+ * mapped once and kept. Null if the module has none. */
+/* The directory is mapped once for the devfd it was first looked up
+ * through and stays mapped, pinning npheap.ko, until npheap_release(). */
+static const struct npheap_dir_header *npheap_dir;
+static size_t npheap_dir_size;
+static int npheap_dir_fd = -1;
+
+void npheap_release(int devfd)
+{
+     if (devfd != npheap_dir_fd)
+          return;
+     if (npheap_dir)
+          munmap((void *)npheap_dir, npheap_dir_size);
+     npheap_dir = NULL;
+     npheap_dir_fd = -1;
+}
+
+static const struct npheap_dir_header *npheap_map_dir(int devfd)
+{
+     const struct npheap_dir_header *hdr;
+     void *dir;
+     size_t size;
+     if (devfd == npheap_dir_fd)
+          return npheap_dir;
+     npheap_release(npheap_dir_fd);
+     npheap_dir_fd = devfd;
+     hdr = mmap(0,getpagesize(),PROT_READ,MAP_SHARED,devfd,NPHEAP_DIR_OFFSET);
+     if (hdr == MAP_FAILED)
+          return NULL;
+     size = hdr->entries_offset + hdr->nr_slots*sizeof(struct npheap_dir_entry);
+     if (hdr->magic != NPHEAP_DIR_MAGIC)
+          size = 0;
+     munmap((void *)hdr, getpagesize());
+     if (size == 0)
+          return NULL;
+     dir = mmap(0,size,PROT_READ,MAP_SHARED,devfd,NPHEAP_DIR_OFFSET);
+     if (dir != MAP_FAILED) {
+          npheap_dir = dir;
+          npheap_dir_size = size;
+     }
+     return npheap_dir;
+}
+
+/* Returns the size of the object at a byte offset, 0 if there is none or
+ * -1 if the directory can't tell. */
+static long npheap_dir_lookup(const struct npheap_dir_header *hdr, __u64 offset)
+{
+     const struct npheap_dir_entry *entries = (const void *)((const char *)hdr + hdr->entries_offset);
+     __u64 slot = npheap_dir_slot(offset, hdr->shift);
+     __u64 i, key, size;
+     __u32 seq, flags;
+     for (i = 0; i < hdr->nr_slots; i++, slot = (slot + 1) & (hdr->nr_slots - 1)) {
+          const struct npheap_dir_entry *e = &entries[slot];
+          /* Retry while the kernel is rewriting the entry. */
+          do {
+               seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+               flags = __atomic_load_n(&e->flags, __ATOMIC_RELAXED);
+               key = __atomic_load_n(&e->offset, __ATOMIC_RELAXED);
+               size = __atomic_load_n(&e->size, __ATOMIC_RELAXED);
+               __atomic_thread_fence(__ATOMIC_ACQUIRE);
+          } while ((seq & 1) || seq != __atomic_load_n(&e->seq, __ATOMIC_RELAXED));
+          if (flags == 0)
+               break;
+          if ((flags & NPHEAP_DIR_USED) && key == offset)
+               return size;
+     }
+     return __atomic_load_n(&hdr->missing, __ATOMIC_RELAXED) ? -1 : 0;
+}
+
+/* Looks an offset up, retrying while the kernel shifts entries around so
+ * a moving entry is never missed. */
+static long npheap_dir_getsize(const struct npheap_dir_header *hdr, __u64 offset)
+{
+     __u32 moves;
+     long size;
+     int tries;
+     for (tries = 0; tries < 8; tries++) {
+          moves = __atomic_load_n(&hdr->moves, __ATOMIC_ACQUIRE);
+          if (moves & 1)
+               continue;
+          size = npheap_dir_lookup(hdr, offset);
+          __atomic_thread_fence(__ATOMIC_ACQUIRE);
+          if (moves == __atomic_load_n(&hdr->moves, __ATOMIC_RELAXED))
+               return size;
+     }
+     return -1;
+}
+
 long npheap_getsize(int devfd, __u64 offset)
 {
      struct npheap_cmd cmd;
+     const struct npheap_dir_header *hdr = npheap_map_dir(devfd);
+     long size;
      cmd.offset = offset*getpagesize();
+     if (hdr && (size = npheap_dir_getsize(hdr, cmd.offset)) >= 0)
+          return size;
      return ioctl(devfd, NPHEAP_IOCTL_GETSIZE, &cmd);
 }
+
+long npheap_delete_range(int devfd, __u64 start, __u64 end)
+{
+     struct npheap_cmd cmd;
+     if (end < start) {
+          errno = EINVAL;
+          return -1;
+     }
+     cmd.offset = start*getpagesize();
+     cmd.size = (end - start)*getpagesize();
+     return ioctl(devfd, NPHEAP_IOCTL_DELETE_RANGE, &cmd);
+}
+
+int npheap_set_ttl(int devfd, __u64 offset, __u64 seconds)
+{
+     struct npheap_cmd cmd;
+     cmd.offset = offset*getpagesize();
+     cmd.size = seconds;
+     return ioctl(devfd, NPHEAP_IOCTL_SET_TTL, &cmd);
+}
+
+int npheap_clone(int devfd, __u64 src, __u64 dst)
+{
+     struct npheap_clone_cmd cmd;
+     cmd.src_offset = src*getpagesize();
+     cmd.dst_offset = dst*getpagesize();
+     return ioctl(devfd, NPHEAP_IOCTL_CLONE, &cmd);
+}
+
+int npheap_snapshot(int devfd)
+{
+     return ioctl(devfd, NPHEAP_IOCTL_SNAPSHOT);
+}
+
+int npheap_checkpoint(int devfd, const char *path)
+{
+     struct npheap_image_header hdr = { NPHEAP_IMAGE_MAGIC, NPHEAP_IMAGE_VERSION };
+     size_t bufsize = 1 << 20;
+     char *buf = malloc(bufsize);
+     int snapfd, imagefd = -1, ret = -1;
+     ssize_t n;
+
+     if (buf == NULL)
+          return -1;
+     snapfd = npheap_snapshot(devfd);
+     if (snapfd < 0)
+          goto out;
+     imagefd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+     if (imagefd < 0)
+          goto out;
+     if (write(imagefd, &hdr, sizeof(hdr)) != sizeof(hdr))
+          goto out;
+     while ((n = read(snapfd, buf, bufsize)) > 0)
+          if (write(imagefd, buf, n) != n)
+               goto out;
+     if (n == 0)
+          ret = fsync(imagefd);
+out:
+     if (imagefd >= 0)
+          close(imagefd);
+     if (snapfd >= 0)
+          close(snapfd);
+     free(buf);
+     return ret;
+}
+
+long npheap_restore(int devfd, const char *path)
+{
+     long ret;
+     int imagefd = open(path, O_RDONLY);
+     if (imagefd < 0)
+          return -1;
+     ret = ioctl(devfd, NPHEAP_IOCTL_RESTORE, imagefd);
+     close(imagefd);
+     return ret;
+}
+
+long npheap_get_dirty(int devfd, __u64 offset, void *bitmap, __u64 bitmap_size)
+{
+     struct npheap_cmd cmd;
+     cmd.offset = offset*getpagesize();
+     cmd.size = bitmap_size;
+     cmd.data = bitmap;
+     return ioctl(devfd, NPHEAP_IOCTL_GET_DIRTY, &cmd);
+}
+
+long npheap_next(int devfd, __u64 *offset)
+{
+     __u64 generation;
+     return npheap_next_generation(devfd, offset, &generation);
+}
+
+long npheap_next_generation(int devfd, __u64 *offset, __u64 *generation)
+{
+     struct npheap_cmd cmd;
+     long size;
+     cmd.offset = *offset*getpagesize();
+     size = ioctl(devfd, NPHEAP_IOCTL_NEXT, &cmd);
+     if (size > 0) {
+          *offset = cmd.offset/getpagesize();
+          *generation = cmd.op;
+     }
+     return size;
+}
+
+static void *npheap_create_id(int devfd, __u64 id, __u64 size, __u64 flags)
+{
+     struct npheap_id_cmd cmd;
+     __u64 aligned_size;
+     void *data;
+     cmd.id = id;
+     cmd.size = size;
+     cmd.flags = flags;
+     if (ioctl(devfd, NPHEAP_IOCTL_CREATE, &cmd) < 0)
+          return MAP_FAILED;
+     aligned_size = ((cmd.size + getpagesize() - 1) / getpagesize())*getpagesize();
+     data = mmap(0,aligned_size,PROT_READ|PROT_WRITE,MAP_SHARED,devfd,cmd.token);
+     /* The module can only populate the mapping once it exists. */
+     if (data != MAP_FAILED && (flags & NPHEAP_CREATE_PREFAULT))
+          npheap_prefault(data, aligned_size);
+     return data;
+}
+
+void *npheap_alloc_id(int devfd, __u64 id, __u64 size)
+{
+     return npheap_create_id(devfd, id, size, 0);
+}
+
+void *npheap_alloc_id_prefault(int devfd, __u64 id, __u64 size)
+{
+     return npheap_create_id(devfd, id, size, NPHEAP_CREATE_PREFAULT);
+}
+
+/* MAP_POPULATE never reaches the module for its PFN mappings, WILLNEED
+ * does. */
+int npheap_prefault(void *addr, __u64 size)
+{
+     __u64 aligned_size= ((size + getpagesize() - 1) / getpagesize())*getpagesize();
+     return madvise(addr, aligned_size, MADV_WILLNEED);
+}
+
+long npheap_getsize_id(int devfd, __u64 id)
+{
+     struct npheap_id_cmd cmd;
+     cmd.id = id;
+     if (ioctl(devfd, NPHEAP_IOCTL_LOOKUP, &cmd) < 0)
+          return 0;
+     return cmd.size;
+}
+
+int npheap_delete_id(int devfd, __u64 id)
+{
+     struct npheap_id_cmd cmd;
+     cmd.id = id;
+     return ioctl(devfd, NPHEAP_IOCTL_DELETE_ID, &cmd);
+}
+
+int npheap_set_checksum(int devfd, __u64 offset, int on)
+{
+     struct npheap_cmd cmd;
+     cmd.offset = offset*getpagesize();
+     cmd.size = on ? 1 : 0;
+     return ioctl(devfd, NPHEAP_IOCTL_SET_CHECKSUM, &cmd);
+}
+
+int npheap_verify(int devfd, __u64 offset)
+{
+     struct npheap_cmd cmd;
+     cmd.offset = offset*getpagesize();
+     return ioctl(devfd, NPHEAP_IOCTL_VERIFY, &cmd);
+}
+
+int npheap_set_tag(int devfd, __u64 offset, __u64 tag)
+{
+     struct npheap_tag_cmd cmd;
+     cmd.offset = offset*getpagesize();
+     cmd.tag = tag;
+     return ioctl(devfd, NPHEAP_IOCTL_SET_TAG, &cmd);
+}
+
+long npheap_tag_list(int devfd, __u64 tag, __u64 *offsets, __u64 max)
+{
+     struct npheap_tag_cmd cmd;
+     long i, n;
+     cmd.tag = tag;
+     cmd.offsets = offsets;
+     cmd.count = max;
+     n = ioctl(devfd, NPHEAP_IOCTL_TAG_LIST, &cmd);
+     for (i = 0; i < n; i++)
+          offsets[i] /= getpagesize();
+     return n;
+}
+
+long long npheap_tag_getsize(int devfd, __u64 tag, __u64 *count)
+{
+     struct npheap_tag_cmd cmd;
+     cmd.tag = tag;
+     if (ioctl(devfd, NPHEAP_IOCTL_TAG_GETSIZE, &cmd) < 0)
+          return -1;
+     if (count)
+          *count = cmd.count;
+     return cmd.bytes;
+}
+
+long npheap_tag_delete(int devfd, __u64 tag)
+{
+     struct npheap_tag_cmd cmd;
+     cmd.tag = tag;
+     return ioctl(devfd, NPHEAP_IOCTL_TAG_DELETE, &cmd);
+}
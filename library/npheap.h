@@ -7,6 +7,29 @@ int npheap_lock(int devfd, __u64 offset);
 int npheap_unlock(int devfd, __u64 offset);
 int npheap_delete(int devfd, __u64 offset);
 long npheap_getsize(int devfd, __u64 offset);
+/* Unmaps what npheap_getsize() mapped to look objects up, which keeps
+ * npheap.ko loaded. Call it before closing devfd. */
+void npheap_release(int devfd);
+long npheap_delete_range(int devfd, __u64 start, __u64 end);
+int npheap_set_ttl(int devfd, __u64 offset, __u64 seconds);
+int npheap_clone(int devfd, __u64 src, __u64 dst);
+int npheap_snapshot(int devfd);
+int npheap_checkpoint(int devfd, const char *path);
+long npheap_restore(int devfd, const char *path);
+long npheap_get_dirty(int devfd, __u64 offset, void *bitmap, __u64 bitmap_size);
+long npheap_next(int devfd, __u64 *offset);
+long npheap_next_generation(int devfd, __u64 *offset, __u64 *generation);
+void *npheap_alloc_id(int devfd, __u64 id, __u64 size);
+void *npheap_alloc_id_prefault(int devfd, __u64 id, __u64 size);
+int npheap_prefault(void *addr, __u64 size);
+long npheap_getsize_id(int devfd, __u64 id);
+int npheap_delete_id(int devfd, __u64 id);
+int npheap_set_checksum(int devfd, __u64 offset, int on);
+int npheap_verify(int devfd, __u64 offset);
+int npheap_set_tag(int devfd, __u64 offset, __u64 tag);
+long npheap_tag_list(int devfd, __u64 tag, __u64 *offsets, __u64 max);
+long long npheap_tag_getsize(int devfd, __u64 tag, __u64 *count);
+long npheap_tag_delete(int devfd, __u64 tag);
 #ifdef __cplusplus
 }
 #endif
\ No newline at end of file
@@ -0,0 +1,473 @@
+// npheap_repd keeps a warm standby of a heap on a peer machine.
+//
+// The sender walks the heap every interval and streams, in compressed
+// batches over TCP, every object created since the last round, the pages
+// written since then (from the kernel's dirty page bitmaps) and every
+// object deleted since then. The receiver applies them to its own heap.
+//
+//   npheap_repd send <host> <port> [-i interval_ms] [-r first:end] [-d dev]
+//   npheap_repd recv <port> [-b base] [-d dev]
+//
+// -r limits the sender to offsets in [first, end) and -b makes the
+// receiver apply offset o at base + o, so both ends can share one heap when
+// testing on a single host, as test_replication.sh does.
+#include <npheap.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <endian.h>
+#include <netdb.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <zlib.h>
+
+#define REPD_MAGIC 0x4450524eu  // "NRPD"
+#define REPD_BATCH (4 << 20)    // bytes of messages per batch
+
+enum { REPD_PUT = 1, REPD_DELETE = 2 };
+
+// Sent ahead of every batch, all fields big endian.
+struct repd_batch {
+    uint32_t magic;
+    uint32_t page_size;
+    uint32_t nr_msgs;
+    uint32_t pad;
+    uint64_t raw_len;   // bytes of messages
+    uint64_t wire_len;  // bytes that follow, raw_len when not compressed
+};
+
+// One change, followed by nr_pages pages of data for a REPD_PUT.
+struct repd_msg {
+    uint32_t type;
+    uint32_t nr_pages;
+    uint64_t offset;
+    uint64_t size;      // object size
+    uint64_t first;     // index of the first page sent
+};
+
+static int devfd, sock, pagesize;
+static char *raw, *wire;
+static size_t raw_len;
+static uint32_t nr_msgs;
+
+// Offsets (and generations) the peer holds after the last round, in order.
+static uint64_t *known, *known_gen;
+static size_t nr_known;
+
+static void die(const char *what)
+{
+    perror(what);
+    exit(1);
+}
+
+static void write_all(const void *buf, size_t len)
+{
+    ssize_t n;
+    while (len > 0) {
+        if ((n = write(sock, buf, len)) <= 0)
+            die("write");
+        buf = (const char *)buf + n;
+        len -= n;
+    }
+}
+
+static int read_all(void *buf, size_t len)
+{
+    ssize_t n;
+    while (len > 0) {
+        if ((n = read(sock, buf, len)) <= 0)
+            return -1;
+        buf = (char *)buf + n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Compresses the pending messages and sends them as one batch.
+static void flush_batch(void)
+{
+    struct repd_batch batch;
+    uLongf wire_len = compressBound(REPD_BATCH);
+    const char *payload = wire;
+
+    if (nr_msgs == 0)
+        return;
+    if (compress2((Bytef *)wire, &wire_len, (Bytef *)raw, raw_len, 1) != Z_OK ||
+        wire_len >= raw_len) {
+        payload = raw;
+        wire_len = raw_len;
+    }
+    batch.magic = htobe32(REPD_MAGIC);
+    batch.page_size = htobe32(pagesize);
+    batch.nr_msgs = htobe32(nr_msgs);
+    batch.pad = 0;
+    batch.raw_len = htobe64(raw_len);
+    batch.wire_len = htobe64(wire_len);
+    write_all(&batch, sizeof(batch));
+    write_all(payload, wire_len);
+    raw_len = 0;
+    nr_msgs = 0;
+}
+
+static void put_msg(uint32_t type, uint64_t offset, uint64_t size,
+                    uint64_t first, uint32_t nr_pages, const char *data)
+{
+    struct repd_msg msg;
+    size_t len = sizeof(msg) + (size_t)nr_pages * pagesize;
+
+    if (raw_len + len > REPD_BATCH)
+        flush_batch();
+    msg.type = htobe32(type);
+    msg.nr_pages = htobe32(nr_pages);
+    msg.offset = htobe64(offset);
+    msg.size = htobe64(size);
+    msg.first = htobe64(first);
+    memcpy(raw + raw_len, &msg, sizeof(msg));
+    if (nr_pages > 0)
+        memcpy(raw + raw_len + sizeof(msg), data, (size_t)nr_pages * pagesize);
+    raw_len += len;
+    nr_msgs++;
+}
+
+static int test_page(const uint64_t *bitmap, uint64_t page)
+{
+    return (bitmap[page / 64] >> (page % 64)) & 1;
+}
+
+// Ships an object whole if the peer hasn't seen it, otherwise its pages
+// written since the last round. The pages are copied out under the heap
+// lock and only sent once it is dropped, so a slow peer never holds up the
+// heap's other users. Returns -1 if the object changed since it was listed.
+static int sync_object(uint64_t offset, uint64_t size, uint64_t gen,
+                       int is_new)
+{
+    uint64_t nr_pages = (size + pagesize - 1) / pagesize;
+    uint64_t max_run = (REPD_BATCH - sizeof(struct repd_msg)) / pagesize;
+    uint64_t words = (nr_pages + 63) / 64, first, last, nr_dirty = 0;
+    uint64_t *dirty = calloc(words, sizeof(uint64_t));
+    char *data, *copy = NULL, *p;
+    __u64 cur = offset, cur_gen;
+    long count;
+    int ret = -1;
+
+    if (dirty == NULL)
+        die("calloc");
+    npheap_lock(devfd, offset);
+    if ((uint64_t)npheap_next_generation(devfd, &cur, &cur_gen) != size ||
+        cur != offset || cur_gen != gen)
+        goto out;
+    ret = 0;
+    count = npheap_get_dirty(devfd, offset, dirty, words * sizeof(uint64_t));
+    if (is_new)
+        memset(dirty, 0xff, words * sizeof(uint64_t));
+    else if (count <= 0)
+        goto out;
+
+    for (first = 0; first < nr_pages; first++)
+        nr_dirty += test_page(dirty, first);
+    data = npheap_alloc(devfd, offset, size);
+    if (data == MAP_FAILED) {
+        npheap_unlock(devfd, offset);
+        die("npheap_alloc");
+    }
+
+    // Mapping recreates the object if a delete that ignores the heap lock
+    // got in since the check above. Nobody holding the lock can have made
+    // a new one, so it is ours and empty: drop it and leave it to the next
+    // round to see it gone.
+    cur = offset;
+    if ((uint64_t)npheap_next_generation(devfd, &cur, &cur_gen) != size ||
+        cur != offset || cur_gen != gen) {
+        munmap(data, nr_pages * pagesize);
+        if (cur == offset && cur_gen != gen)
+            npheap_delete(devfd, offset);
+        ret = -1;
+        goto out;
+    }
+    copy = malloc(nr_dirty * pagesize);
+    if (copy == NULL) {
+        npheap_unlock(devfd, offset);
+        die("malloc");
+    }
+    for (first = 0, p = copy; first < nr_pages; first++)
+        if (test_page(dirty, first)) {
+            memcpy(p, data + first * pagesize, pagesize);
+            p += pagesize;
+        }
+    munmap(data, nr_pages * pagesize);
+out:
+    npheap_unlock(devfd, offset);
+
+    if (copy != NULL) {
+        for (first = 0, p = copy; first < nr_pages; first = last) {
+            if (!test_page(dirty, first)) {
+                last = first + 1;
+                continue;
+            }
+            for (last = first + 1; last < nr_pages && last - first < max_run &&
+                                   test_page(dirty, last); last++)
+                ;
+            put_msg(REPD_PUT, offset, size, first, last - first, p);
+            p += (last - first) * pagesize;
+        }
+    }
+    free(copy);
+    free(dirty);
+    return ret;
+}
+
+// One pass over [first, end) of the heap.
+static void sync_round(uint64_t first, uint64_t end)
+{
+    uint64_t *seen = NULL, *seen_gen = NULL;
+    size_t nr_seen = 0, cap = 0, k = 0;
+    __u64 offset = first, gen;
+    int was_known;
+    long size;
+
+    while (offset < end &&
+           (size = npheap_next_generation(devfd, &offset, &gen)) > 0 &&
+           offset < end) {
+        if (nr_seen == cap) {
+            cap = cap ? 2 * cap : 1024;
+            seen = realloc(seen, cap * sizeof(uint64_t));
+            seen_gen = realloc(seen_gen, cap * sizeof(uint64_t));
+            if (seen == NULL || seen_gen == NULL)
+                die("realloc");
+        }
+        while (k < nr_known && known[k] < offset) {
+            put_msg(REPD_DELETE, known[k], 0, 0, 0, NULL);
+            k++;
+        }
+        // A generation of its own tells an object deleted and recreated
+        // at the same offset, even of the same size, from the one the peer
+        // has, so the new one is shipped whole.
+        was_known = k < nr_known && known[k] == offset && known_gen[k] == gen;
+        if (k < nr_known && known[k] == offset)
+            k++;
+
+        // An object replaced since it was listed is dropped on the peer
+        // and shipped whole next round.
+        if (sync_object(offset, size, gen, !was_known) == 0) {
+            seen[nr_seen] = offset;
+            seen_gen[nr_seen++] = gen;
+        } else if (was_known)
+            put_msg(REPD_DELETE, offset, 0, 0, 0, NULL);
+        offset++;
+    }
+    for (; k < nr_known; k++)
+        put_msg(REPD_DELETE, known[k], 0, 0, 0, NULL);
+    flush_batch();
+
+    free(known);
+    free(known_gen);
+    known = seen;
+    known_gen = seen_gen;
+    nr_known = nr_seen;
+}
+
+static void run_sender(const char *host, const char *port, int interval_ms,
+                       uint64_t first, uint64_t end)
+{
+    struct addrinfo hints = { .ai_socktype = SOCK_STREAM }, *res, *ai;
+    int one = 1, err;
+
+    if ((err = getaddrinfo(host, port, &hints, &res)) != 0) {
+        fprintf(stderr, "%s: %s\n", host, gai_strerror(err));
+        exit(1);
+    }
+    for (ai = res; ai != NULL; ai = ai->ai_next) {
+        sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (sock >= 0 && connect(sock, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        if (sock >= 0)
+            close(sock);
+    }
+    freeaddrinfo(res);
+    if (ai == NULL)
+        die("connect");
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    for (;;) {
+        sync_round(first, end);
+        usleep(interval_ms * 1000);
+    }
+}
+
+static void apply_put(uint64_t offset, uint64_t size, uint64_t first,
+                      uint32_t nr_pages, const char *payload)
+{
+    uint64_t aligned = (size + pagesize - 1) / pagesize * pagesize;
+    long cur;
+    char *data;
+
+    if (size == 0 || aligned < size || first > aligned / pagesize ||
+        nr_pages > aligned / pagesize - first) {
+        fprintf(stderr, "bad page run at offset %llu\n",
+                (unsigned long long)offset);
+        return;
+    }
+    npheap_lock(devfd, offset);
+    cur = npheap_getsize(devfd, offset);
+    if (cur > 0 && (uint64_t)cur != aligned)
+        npheap_delete(devfd, offset);
+    data = npheap_alloc(devfd, offset, size);
+    if (data == MAP_FAILED)
+        die("npheap_alloc");
+    memcpy(data + first * pagesize, payload, (size_t)nr_pages * pagesize);
+    munmap(data, aligned);
+    npheap_unlock(devfd, offset);
+}
+
+// Applies one batch, returns -1 once the sender went away.
+static int apply_batch(uint64_t base)
+{
+    struct repd_batch batch;
+    struct repd_msg msg;
+    uLongf len;
+    uint64_t raw_size, wire_len, offset, nr_pages;
+    uint32_t i, count;
+    const char *p, *end;
+
+    if (read_all(&batch, sizeof(batch)))
+        return -1;
+    raw_size = be64toh(batch.raw_len);
+    wire_len = be64toh(batch.wire_len);
+    if (be32toh(batch.magic) != REPD_MAGIC ||
+        be32toh(batch.page_size) != (uint32_t)pagesize ||
+        raw_size > REPD_BATCH || wire_len > compressBound(REPD_BATCH)) {
+        fprintf(stderr, "bad batch header\n");
+        return -1;
+    }
+    if (read_all(wire, wire_len))
+        return -1;
+    p = wire;
+    if (wire_len != raw_size) {
+        len = raw_size;
+        if (uncompress((Bytef *)raw, &len, (Bytef *)wire, wire_len) != Z_OK ||
+            len != raw_size) {
+            fprintf(stderr, "bad batch data\n");
+            return -1;
+        }
+        p = raw;
+    }
+
+    // Never trust the counts in a batch to stay within it.
+    end = p + raw_size;
+    count = be32toh(batch.nr_msgs);
+    for (i = 0; i < count; i++) {
+        if ((size_t)(end - p) < sizeof(msg)) {
+            fprintf(stderr, "truncated batch\n");
+            return -1;
+        }
+        memcpy(&msg, p, sizeof(msg));
+        p += sizeof(msg);
+        offset = base + be64toh(msg.offset);
+        if (be32toh(msg.type) == REPD_DELETE) {
+            npheap_lock(devfd, offset);
+            npheap_delete(devfd, offset);
+            npheap_unlock(devfd, offset);
+        } else {
+            nr_pages = be32toh(msg.nr_pages);
+            if ((uint64_t)(end - p) / pagesize < nr_pages ||
+                be64toh(msg.first) > UINT64_MAX - nr_pages) {
+                fprintf(stderr, "truncated batch\n");
+                return -1;
+            }
+            apply_put(offset, be64toh(msg.size), be64toh(msg.first),
+                      nr_pages, p);
+            p += nr_pages * pagesize;
+        }
+    }
+    return 0;
+}
+
+static void run_receiver(const char *port, uint64_t base)
+{
+    struct addrinfo hints = { .ai_socktype = SOCK_STREAM,
+                              .ai_flags = AI_PASSIVE }, *res;
+    int listener, one = 1, err;
+
+    if ((err = getaddrinfo(NULL, port, &hints, &res)) != 0) {
+        fprintf(stderr, "%s: %s\n", port, gai_strerror(err));
+        exit(1);
+    }
+    listener = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (listener < 0)
+        die("socket");
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(listener, res->ai_addr, res->ai_addrlen) || listen(listener, 1))
+        die("bind");
+    freeaddrinfo(res);
+
+    for (;;) {
+        if ((sock = accept(listener, NULL, NULL)) < 0)
+            die("accept");
+        while (apply_batch(base) == 0)
+            ;
+        close(sock);
+    }
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s send host port [-i interval_ms] "
+            "[-r first:end] [-d device]\n"
+            "       %s recv port [-b base] [-d device]\n", prog, prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *device = "/dev/npheap";
+    unsigned long long first = 0, end = UINT64_MAX, base = 0;
+    int interval_ms = 100, sender, opt;
+
+    if (argc < 3)
+        usage(argv[0]);
+    sender = strcmp(argv[1], "send") == 0;
+    if (!sender && strcmp(argv[1], "recv") != 0)
+        usage(argv[0]);
+    if (sender && argc < 4)
+        usage(argv[0]);
+    optind = sender ? 4 : 3;
+    while ((opt = getopt(argc, argv, "i:r:b:d:")) != -1) {
+        switch (opt) {
+        case 'i':
+            interval_ms = atoi(optarg);
+            break;
+        case 'r':
+            if (sscanf(optarg, "%llu:%llu", &first, &end) != 2)
+                usage(argv[0]);
+            break;
+        case 'b':
+            base = strtoull(optarg, NULL, 0);
+            break;
+        case 'd':
+            device = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    pagesize = getpagesize();
+    raw = malloc(REPD_BATCH);
+    wire = malloc(compressBound(REPD_BATCH));
+    if (raw == NULL || wire == NULL)
+        die("malloc");
+    devfd = open(device, O_RDWR);
+    if (devfd < 0)
+        die(device);
+
+    if (sender)
+        run_sender(argv[2], argv[3], interval_ms, first, end);
+    else
+        run_receiver(argv[2], base);
+    return 0;
+}
@@ -0,0 +1,132 @@
+// repd_check drives and checks a loopback run of npheap_repd, see
+// test_replication.sh.
+//
+//   repd_check fill <first> <end> <round> [-d dev]
+//   repd_check compare <first> <end> <base> [-d dev]
+//
+// fill round 0 creates an object of 1 to 4 pages at every offset in
+// [first, end). Later rounds rewrite a page of every other object and
+// delete and recreate every third one at the same size with only its first
+// page written, so stale pages on the peer show up. compare checks that
+// [base + first, base + end) holds exactly the objects of [first, end).
+#include <npheap.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+static int devfd, pagesize;
+
+static uint64_t object_size(uint64_t offset)
+{
+    return (offset % 4 + 1) * pagesize;
+}
+
+static void fill_page(char *page, uint64_t offset, uint64_t index,
+                      uint64_t round)
+{
+    snprintf(page, pagesize, "object %llu page %llu round %llu",
+             (unsigned long long)offset, (unsigned long long)index,
+             (unsigned long long)round);
+}
+
+static int fill(uint64_t first, uint64_t end, uint64_t round)
+{
+    uint64_t offset, size, i;
+    char *data;
+
+    for (offset = first; offset < end; offset++) {
+        size = object_size(offset);
+        npheap_lock(devfd, offset);
+        if (round > 0 && offset % 3 == 0)
+            npheap_delete(devfd, offset);
+        data = npheap_alloc(devfd, offset, size);
+        if (data == MAP_FAILED) {
+            perror("npheap_alloc");
+            return 1;
+        }
+        if (round == 0)
+            for (i = 0; i < size / pagesize; i++)
+                fill_page(data + i * pagesize, offset, i, round);
+        else if (offset % 3 == 0 || offset % 2 == 0)
+            fill_page(data, offset, 0, round);
+        munmap(data, size);
+        npheap_unlock(devfd, offset);
+    }
+    return 0;
+}
+
+static int compare(uint64_t first, uint64_t end, uint64_t base)
+{
+    __u64 offset = first, peer = base + first;
+    char *data, *copy;
+    long size;
+    int bad = 0;
+
+    while ((size = npheap_next(devfd, &offset)) > 0 && offset < end) {
+        if (npheap_getsize(devfd, base + offset) != size) {
+            fprintf(stderr, "object %llu: size differs\n",
+                    (unsigned long long)offset);
+            bad = 1;
+        } else {
+            data = npheap_alloc(devfd, offset, size);
+            copy = npheap_alloc(devfd, base + offset, size);
+            if (data == MAP_FAILED || copy == MAP_FAILED) {
+                perror("npheap_alloc");
+                return 1;
+            }
+            if (memcmp(data, copy, size) != 0) {
+                fprintf(stderr, "object %llu: data differs\n",
+                        (unsigned long long)offset);
+                bad = 1;
+            }
+            munmap(data, size);
+            munmap(copy, size);
+        }
+        offset++;
+    }
+
+    // Nothing may be left on the peer that the source no longer has.
+    while (npheap_next(devfd, &peer) > 0 && peer < base + end) {
+        if (npheap_getsize(devfd, peer - base) <= 0) {
+            fprintf(stderr, "object %llu: left on the peer\n",
+                    (unsigned long long)(peer - base));
+            bad = 1;
+        }
+        peer++;
+    }
+    if (!bad)
+        printf("[%llu, %llu) replicated correctly\n",
+               (unsigned long long)first, (unsigned long long)end);
+    return bad;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *device = "/dev/npheap";
+    uint64_t first, end, arg;
+
+    if (argc != 5 && !(argc == 7 && strcmp(argv[5], "-d") == 0)) {
+        fprintf(stderr, "Usage: %s fill first end round [-d device]\n"
+                "       %s compare first end base [-d device]\n",
+                argv[0], argv[0]);
+        exit(1);
+    }
+    if (argc == 7)
+        device = argv[6];
+    first = strtoull(argv[2], NULL, 0);
+    end = strtoull(argv[3], NULL, 0);
+    arg = strtoull(argv[4], NULL, 0);
+    pagesize = getpagesize();
+    devfd = open(device, O_RDWR);
+    if (devfd < 0) {
+        perror(device);
+        exit(1);
+    }
+    if (strcmp(argv[1], "fill") == 0)
+        return fill(first, end, arg);
+    return compare(first, end, arg);
+}
@@ -0,0 +1,13 @@
+# This script compares the module with and without its statistics and with per-object checksums, it accepts 2 arguments, number_of_processes and iterations (default 64 and 100000).
+number_of_processes=${1:-64}
+iterations=${2:-100000}
+sudo insmod kernel_module/npheap.ko
+sudo chmod 777 /dev/npheap
+echo "Counters on: $number_of_processes $iterations"
+./benchmark/counters $number_of_processes $iterations
+echo 0 | sudo tee /sys/module/npheap/parameters/stats > /dev/null
+echo "Counters off: $number_of_processes $iterations"
+./benchmark/counters $number_of_processes $iterations
+echo "Counters off, checksums on: $number_of_processes $iterations"
+./benchmark/counters $number_of_processes $iterations checksum
+sudo rmmod npheap
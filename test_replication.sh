@@ -0,0 +1,22 @@
+# This script replicates a range of the heap onto another range of the same heap over loopback and compares the two, it accepts 2 arguments, number_of_objects and port (default 1000 and 7450).
+number_of_objects=${1:-1000}
+port=${2:-7450}
+end=$((number_of_objects + 1))
+base=1000000
+sudo insmod kernel_module/npheap.ko
+sudo chmod 777 /dev/npheap
+./replication/npheap_repd recv $port -b $base &
+receiver=$!
+sleep 1
+./replication/repd_check fill 1 $end 0
+./replication/npheap_repd send 127.0.0.1 $port -i 100 -r 1:$end &
+sender=$!
+sleep 2
+./replication/repd_check fill 1 $end 1
+sleep 2
+./replication/repd_check compare 1 $end $base
+status=$?
+kill $sender $receiver
+wait
+sudo rmmod npheap
+exit $status